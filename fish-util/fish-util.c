@@ -6,11 +6,6 @@
 
 #define _GNU_SOURCE // here, not header, not exported
 
-/* For errors and warnings.
- */
-#define COMPLAINT_LENGTH F_COMPLAINT_LENGTH
-#define INFO_LENGTH 300
-
 #define SOCKET_LENGTH_DEFAULT 100
 
 #define STATIC_STR_LENGTH 200
@@ -21,6 +16,50 @@
 
 #define NUM_STATIC_STRINGS 8
 
+/* Size classes of the small-string pool: block sizes including the header,
+ * from 32 up to 32 << (F_POOL_NUM_CLASSES - 1).
+ */
+#define POOL_HDR 16
+#define POOL_MIN_BLOCK 32
+#define POOL_SLAB_SIZE (16 * 1024)
+#define POOL_CLASS_NONE 0xFF
+
+/* Heap profiler: stacks are aggregated in a fixed open-addressing table.
+ */
+#define PROF_TABLE_SIZE 4096
+#define PROF_MAX_DEPTH 32
+/* How far up the stack to look for the entry point's caller, see
+ * _prof_sample.
+ */
+#define PROF_SKIP_FRAMES 8
+
+#define ARENA_BLOCK_DEFAULT (64 * 1024)
+#define ARENA_ALIGN 16
+
+#define INTERN_SIZE_INIT 256
+
+/* Big allocations are rounded up to, and aligned on, huge pages, with the
+ * mapping length in a header in front of the data.
+ */
+#define BIG_PAGE (2 * 1024 * 1024)
+#define BIG_HDR 64
+#define BIG_THRESHOLD_DEFAULT (4 * 1024 * 1024)
+
+#define LOG_MAX_MODULES 32
+#define LOG_MODULE_LENGTH 64
+
+#define ASYNC_RING_DEFAULT (256 * 1024)
+
+#define FLIGHT_RING_DEFAULT (64 * 1024)
+
+#define SINK_MAX 16
+#define SINK_BUF_DEFAULT (64 * 1024)
+#define ASYNC_IOV 64
+// ms, also how often the writer thread looks without being woken.
+#define ASYNC_WAIT 100
+
+#define PATH_CACHE_SIZE 64
+
 #define unknown_sig(signal) "Signal number " #signal // stringify
 #define signame_(n, d) do { \
     if (name) *name = n; \
@@ -61,10 +100,32 @@
 #include <stddef.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 
+// malloc_usable_size
+#include <malloc.h>
+
+// backtrace
+#include <execinfo.h>
+
 #include <wchar.h>
 
+#include <pthread.h>
+
+// mmap, mremap
+#include <sys/mman.h>
+
+// open
+#include <fcntl.h>
+
+#include <spawn.h>
+#include <sys/wait.h>
+// wait4
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
 /* stat */
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -76,17 +137,44 @@
 /* Private headers.
  */
 
-static char **_get_static_str_ptr ();
+static char *_get_static_str_ptr ();
 static char *_color (const char *s, int idx);
 static void _static_str_init ();
-static void _color_static (const char *c);
+static void _static_str_ensure ();
+static void _color_static (const char *s, int idx);
+static bool _colors_on ();
 static void _sys_say (const char *cmd);
+struct sys_child;
+static bool _sys_child_take (FILE *f, struct sys_child *child);
+static FILE *_sysv_open (char *const argv[], const char *cmd, bool reading);
+static pid_t _sys_child_find (FILE *f, struct timespec *start);
+static bool _sys_drain (FILE *f);
+static long _sys_left_ms (const struct timespec *start);
+static int _sys_status (int status, const char *cmd, int flags);
+static FILE *_coproc_sysr (const char *cmd);
+static int _coproc_sys (const char *cmd, f_strbuf *out, size_t max, int flags);
+static void _path_cache_free ();
 static void _static_strings_free ();
+static void _pool_release ();
+static void _alloc_account (int func, size_t size, void *ptr);
+static void _alloc_outstanding_add (long n);
+static long _prof_rate_get ();
+static void _prof_sample (size_t size, void *caller);
+static void *_f_malloc (size_t s, void *caller);
+static void *_f_pool_malloc (size_t size, void *caller);
+static void _intern_free ();
+static void _sites_report ();
+static const char *_site_prefix (struct f_site *site);
+static void _warn_prefix_append (f_strbuf *b, const char *file, int line, bool color);
+static void _vcomplain (const char *file, unsigned int line, struct f_site *site, bool iserr, bool do_perr, const char *format, va_list arglist);
+static void _log_timestamp (f_strbuf *b);
+static void _flight_record (const char *buf, size_t len);
+static void _emit (int class, const char *buf, size_t len);
 
 /* Public.
  */
 
-char *_s, *_t, *_u, *_v, *_w, *_x, *_y, *_z;
+__thread char *_s, *_t, *_u, *_v, *_w, *_x, *_y, *_z;
 
 /* Private.
  */
@@ -100,10 +188,22 @@ static short NUM_BULLETS = sizeof (BULLETS) / sizeof (char*);
 static struct stat *mystat;
 static bool mystat_initted = false;
 
-static int _static_str_idx = -1;
-static bool _static_str_initted = false;
-static char **_static_strs[NUM_STATIC_STRINGS];
-static bool _static_strings_freed = false;
+/* The static strings are a ring per thread, made on first use. The first
+ * NUM_STATIC_STRINGS slots are _s .. _z, any more are only reachable with
+ * f_get_static_str. The slots are one block, with a scratch slot at the
+ * end for spr.
+ */
+static int _static_str_num_conf = NUM_STATIC_STRINGS;
+static int _static_str_len_conf = STATIC_STR_LENGTH;
+static __thread int _static_str_num;
+static __thread int _static_str_len;
+static __thread int _static_str_idx = -1;
+static __thread bool _static_str_initted = false;
+static __thread char *_static_str_mem = NULL;
+
+// frees the ring when a thread exits.
+static pthread_key_t _static_str_key;
+static pthread_once_t _static_str_once = PTHREAD_ONCE_INIT;
 
 static char *COL[] = {
     // reset
@@ -134,29 +234,272 @@ static char *COL[] = {
     "[95m",
 };
 
-/* static by default.
- *
- * index to COL array.
- */
-enum COLORS {
-    RED=1,
-    BRIGHT_RED,
-    GREEN,
-    BRIGHT_GREEN,
-    YELLOW,
-    BRIGHT_YELLOW,
-    BLUE,
-    BRIGHT_BLUE,
-    CYAN,
-    BRIGHT_CYAN,
-    MAGENTA,
-    BRIGHT_MAGENTA,
+/* enum f_colors (fish-util.h) indexes the COL array.
+ */
+
+/* Thread-local free lists for the small-string pool, one per size class.
+ * A free block stores the next pointer in its first bytes; a used block
+ * stores its class in the header, and the caller gets the bytes after it.
+ */
+static bool _pool_enabled = false;
+static __thread void *_pool_lists[F_POOL_NUM_CLASSES];
+static __thread void *_pool_slabs = NULL;
+static __thread struct f_pool_stats _pool_stats[F_POOL_NUM_CLASSES];
+
+// gives the slabs back when a thread exits.
+static pthread_key_t _pool_key;
+static pthread_once_t _pool_once = PTHREAD_ONCE_INIT;
+
+/* Allocation accounting, switched on with F_ALLOC_STATS.
+ * Counters are relaxed atomics: they're for reporting, not for ordering.
+ * Outstanding bytes are in malloc_usable_size units and only go down for memory
+ * given back through f_free or f_realloc.
+ */
+static bool _alloc_stats = false;
+static bool _alloc_stats_dump = false;
+static struct f_alloc_stats _astats;
+
+static const char *ALLOC_FUNCS[] = {
+    "f_malloc", "f_calloc", "f_realloc", "f_strdup", "f_strndup",
+};
+
+struct prof_entry {
+    unsigned long hash;
+    int depth;
+    void *frames[PROF_MAX_DEPTH];
+    long count;
+    long bytes;
+    double est_bytes;
+};
+
+/* 0 means the profiler is off -- the only thing the allocators check.
+ */
+static long _prof_rate = 0;
+static struct prof_entry *_prof_table = NULL;
+static long _prof_dropped = 0;
+static char _prof_lock = 0;
+static __thread long _prof_left = 0;
+static __thread unsigned long _prof_seed = 0;
+static __thread bool _prof_busy = false;
+
+/* Interned strings live in an arena, behind a header with their hash and
+ * length. The table is open addressing and only grows. Readers don't lock:
+ * slots are filled with release stores, and a grown table is published
+ * the same way. Old tables stay around (in the prev chain) until cleanup,
+ * for readers which might still be looking at them.
+ */
+struct intern_entry {
+    unsigned long hash;
+    size_t len;
+    char str[];
+};
+
+struct intern_table {
+    size_t size; // power of 2
+    struct intern_entry **slots;
+    struct intern_table *prev;
+};
+
+static struct intern_table *_intern_table = NULL;
+// changed under _intern_lock, read without it: atomics either way.
+static size_t _intern_count = 0;
+static f_arena *_intern_arena = NULL;
+static pthread_mutex_t _intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t _big_threshold = BIG_THRESHOLD_DEFAULT;
+static int _big_flags = 0;
+
+/* Async logging: each producing thread has a single-producer,
+ * single-consumer ring of records (header, then the bytes), and the writer
+ * thread drains all rings with writev. head and tail only grow; the
+ * position in the ring is the offset masked with size - 1.
+ */
+struct async_rec {
+    unsigned int len;
+    int fd;
+};
+
+struct async_ring {
+    char *buf;
+    size_t size; // power of 2
+    size_t head; // written by the producer
+    size_t tail; // written by the writer thread
+    long dropped;
+    bool dead; // thread has exited
+    struct async_ring *next;
+};
+
+// atomic: producers read it without the lock (see _async_enter).
+static bool _async_on = false;
+// producers between _async_enter and _async_leave.
+static long _async_users = 0;
+static int _async_policy = F_ASYNC_BLOCK;
+static size_t _async_ring_size = ASYNC_RING_DEFAULT;
+static struct async_ring *_async_rings = NULL;
+static __thread struct async_ring *_async_my_ring = NULL;
+static pthread_t _async_thread;
+static pthread_mutex_t _async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _async_wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _async_flushed_cond = PTHREAD_COND_INITIALIZER;
+// producers waiting for room (F_ASYNC_BLOCK), under _async_lock.
+static pthread_cond_t _async_room_cond = PTHREAD_COND_INITIALIZER;
+static long _async_blocked = 0;
+static bool _async_sleeping = false;
+// bumped by every _async_wake, under _async_lock.
+static long _async_wakes = 0;
+static bool _async_stopping = false;
+static long _async_flush_req = 0;
+static long _async_flush_done = 0;
+static long _async_dropped_total = 0;
+static pthread_key_t _async_key;
+static pthread_once_t _async_once = PTHREAD_ONCE_INIT;
+static bool _async_atexit_set = false;
+
+/* Log levels. Module overrides are meant to be set up front (FISH_LOG);
+ * they aren't locked.
+ * _log_gen goes up with every change, to invalidate the call site caches.
+ */
+int _f_log_threshold = 0;
+static int _log_level = F_LOG_DEBUG;
+static pthread_once_t _log_once = PTHREAD_ONCE_INIT;
+// FISH_LOG is being read by this thread: warnings mustn't wait for it.
+static __thread bool _log_initting = false;
+static long _log_gen = 1;
+static int _log_format = F_LOG_FORMAT_TEXT;
+static int _log_num_modules = 0;
+static struct {
+    char name[LOG_MODULE_LENGTH];
+    int level;
+} _log_modules[LOG_MAX_MODULES];
+
+int _f_rate_burst = 0;
+static int _rate_interval_ms = 0;
+// sites with suppressed messages, reported at cleanup.
+static struct f_site *_sites = NULL;
+// last look for quiet sites, see _sites_sweep.
+static long _sites_swept = 0;
+
+/* Flight recorder rings. Only the owning thread writes one; a ring whose
+ * thread has exited is taken over by the next new thread. Never freed, so
+ * the dumper can walk them at any time.
+ */
+struct flight_ring {
+    char *buf;
+    size_t size;
+    unsigned long head; // total bytes written
+    int owned;
+    int num;
+    struct flight_ring *next;
+};
+
+bool _f_flight_debug = false;
+static bool _flight_on = false;
+static size_t _flight_size = FLIGHT_RING_DEFAULT;
+static struct flight_ring *_flight_rings = NULL;
+static __thread struct flight_ring *_flight_my_ring = NULL;
+static int _flight_num = 0;
+static pthread_key_t _flight_key;
+static pthread_once_t _flight_once = PTHREAD_ONCE_INIT;
+
+enum sink_types {
+    SINK_FD = 1,
+    SINK_MEMORY,
+    SINK_CALLBACK,
+};
+
+/* Sinks live in _sinks and are never freed; a thread's buffer for a sink
+ * remembers the id, so a buffer for a destroyed sink is dropped.
+ */
+struct f_sink {
+    int type;
+    int id;
+    int fd;
+    bool own_fd;
+    size_t bufsize;
+    int flush_ms;
+    pthread_mutex_t lock; // memory
+    char *ring;
+    size_t size;
+    unsigned long long total;
+    f_sink_func func;
+    void *data;
+};
+
+struct sink_tbuf {
+    struct f_sink *sink;
+    int id;
+    pthread_mutex_t lock; // vs. the flusher and f_out_flush
+    char *buf;
+    size_t len;
+    long last; // ms
+    struct sink_tbuf *next; // this thread's
+    struct sink_tbuf *all_next, *all_prev;
 };
 
+static struct f_sink _sinks[SINK_MAX];
+// writers in each slot (see _sink_enter); outside the struct, which gets
+// cleared when the slot is reused.
+static long _sink_users[SINK_MAX];
+// atomic: read by writers without _sink_lock.
+static struct f_sink *_out_sinks[F_OUT_NUM_CLASSES];
+static int _sink_id = 0;
+static pthread_mutex_t _sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sink_tbuf *_sink_tbufs = NULL; // all threads
+static __thread struct sink_tbuf *_sink_my_tbufs = NULL;
+static pthread_key_t _sink_key;
+static pthread_once_t _sink_once = PTHREAD_ONCE_INIT;
+static int _sink_tick_ms = 0;
+static bool _sink_flusher_started = false;
+
+static bool _log_ts = false;
+static int _log_ts_flags = 0;
+// f_timestamp: the formatted second, per thread.
+static __thread time_t _ts_sec = -1;
+static __thread int _ts_utc = 0;
+static __thread char _ts_prefix[32];
+static __thread int _ts_len = 0;
+
 static int _disable_colors = 0;
+// isatty (stdout), checked once. -1: not yet.
+static int _stdout_tty = -1;
 static bool _die = false;
 static bool _verbose = true;
 
+/* FILEs from sysv_r / sysv_w, so sysclose knows to wait for the pid
+ * instead of pclose.
+ * Coprocess sysr FILEs have pid -1: the command is done, and status is
+ * its wait status.
+ * sysrw children have no FILE: buf is the cmd, for sysrw_pump.
+ */
+struct sys_child {
+    FILE *f;
+    pid_t pid;
+    struct timespec start;
+    int status;
+    char *buf;
+};
+static struct sys_child *_sys_children = NULL;
+static int _sys_children_num = 0;
+static int _sys_children_cap = 0;
+static pthread_mutex_t _sys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// f_sys_timeout, in ms; 0: none.
+static long _sys_timeout_ms = 0;
+static long _sys_grace_ms = 0;
+static __thread struct f_sys_usage _sys_usage;
+static __thread bool _sys_usage_set = false;
+// f_sys_coproc.
+static bool _coproc_on = false;
+
+// name -> full path, reset when PATH changes.
+static bool _path_cache_on = false;
+static char *_path_cache_path = NULL;
+static int _path_cache_num = 0;
+static struct {
+    char *name;
+    char *full;
+} _path_cache[PATH_CACHE_SIZE];
+
 /* Returns random double from [0, r).
  * Caller should check for overflows etc.
  * Don't use this function, ever, at all. Only sometimes.
@@ -204,702 +547,4546 @@ char *f_dirname (const char *s) {
     }
     char *t = f_strdup (s);
     char *ret = dirname (t);
-    free (t);
+    f_free (t);
     return ret;
 }
 
-void *f_malloc (size_t s) {
+/* The entry points pass down the address they return to, so that the
+ * profiler can drop the library's own frames however deep the wrappers
+ * go (str -> f_malloc, f_pool_str -> f_pool_malloc -> f_malloc).
+ */
+static void *_f_malloc (size_t s, void *caller) {
     void *ptr = malloc (s);
     if (!ptr && s) // NULL ok if s is 0
         oom_fatal ();
+    if (_alloc_stats)
+        _alloc_account (F_ALLOC_MALLOC, s, ptr);
+    if (_prof_rate_get ())
+        _prof_sample (s, caller);
     return ptr;
 }
 
-void *f_calloc (size_t nmemb, size_t size) {
+__attribute__ ((noinline)) void *f_malloc (size_t s) {
+    return _f_malloc (s, __builtin_return_address (0));
+}
+
+__attribute__ ((noinline)) void *f_calloc (size_t nmemb, size_t size) {
     void *ptr = calloc (nmemb, size);
     if (!ptr && nmemb && size) // NULL ok if size or nmemb is 0
         oom_fatal ();
+    if (_alloc_stats)
+        _alloc_account (F_ALLOC_CALLOC, nmemb * size, ptr);
+    if (_prof_rate_get ())
+        _prof_sample (nmemb * size, __builtin_return_address (0));
     return ptr;
 }
 
-void *f_realloc (void *ptr, size_t size) {
+__attribute__ ((noinline)) void *f_realloc (void *ptr, size_t size) {
+    long prof = _prof_rate_get ();
+    long old = ((_alloc_stats || prof) && ptr) ? malloc_usable_size (ptr) : 0;
     void *new = realloc (ptr, size);
     if (!new && size) // NULL can mean size is 0
         oom_fatal ();
+    if (_alloc_stats) {
+        _alloc_outstanding_add (-old);
+        _alloc_account (F_ALLOC_REALLOC, size, new);
+    }
+    // only the growth is new memory.
+    if (prof && (long) size > old)
+        _prof_sample (size - old, __builtin_return_address (0));
     return new;
 }
 
-char *f_strdup (const char *s) {
+__attribute__ ((noinline)) char *f_strdup (const char *s) {
     char *ret = strdup (s);
     if (!ret)
         oom_fatal ();
+    if (_alloc_stats)
+        _alloc_account (F_ALLOC_STRDUP, strlen (ret) + 1, ret);
+    if (_prof_rate_get ())
+        _prof_sample (strlen (ret) + 1, __builtin_return_address (0));
     return ret;
 }
 
-char *f_strndup (const char *s, size_t n) {
+__attribute__ ((noinline)) char *f_strndup (const char *s, size_t n) {
     char *ret = strndup (s, n);
     if (!ret)
         oom_fatal ();
+    if (_alloc_stats)
+        _alloc_account (F_ALLOC_STRNDUP, strlen (ret) + 1, ret);
+    if (_prof_rate_get ())
+        _prof_sample (strlen (ret) + 1, __builtin_return_address (0));
     return ret;
 }
 
-/* init not necessary, unless you want to start over after having called
- * _cleanup. (And even then it's not (currently) necessary).
+/* Plain free is fine too, but then the memory stays in the outstanding
+ * count.
  */
-void fish_util_init () {
-    _static_str_init ();
-    /* Merge these? XX
-     */
-    _static_str_initted = true;
-    _static_strings_freed = false;
+void f_free (void *ptr) {
+    if (_alloc_stats && ptr)
+        _alloc_outstanding_add (- (long) malloc_usable_size (ptr));
+    free (ptr);
 }
 
-void fish_util_cleanup () {
-    if (!_static_strings_freed) {
-        _static_strings_free ();
-        _static_strings_freed = true;
-    }
-    if (mystat_initted) {
-        free (mystat);
-        mystat_initted = false;
-    }
+/* Bucket i counts sizes up to 16 << i; the last one everything bigger.
+ */
+static int _alloc_bucket (size_t size) {
+    if (size <= 16)
+        return 0;
+    int bits = 8 * sizeof (long) - __builtin_clzl (size - 1);
+    int i = bits - 4;
+    return i < F_ALLOC_HIST_BUCKETS ? i : F_ALLOC_HIST_BUCKETS - 1;
 }
 
-/* Caller shouldn't free.
+static void _alloc_outstanding_add (long n) {
+    long out = __atomic_add_fetch (&_astats.outstanding, n, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n (&_astats.outstanding_peak, __ATOMIC_RELAXED);
+    while (out > peak)
+        if (__atomic_compare_exchange_n (&_astats.outstanding_peak, &peak, out, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+}
+
+static void _alloc_account (int func, size_t size, void *ptr) {
+    __atomic_add_fetch (&_astats.calls[func], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&_astats.bytes[func], size, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&_astats.hist[_alloc_bucket (size)], 1, __ATOMIC_RELAXED);
+    if (ptr)
+        _alloc_outstanding_add (malloc_usable_size (ptr));
+}
+
+/* Snapshot; the counters aren't read all at the same instant.
  */
-FILE *safeopen_f (const char *filespec, int flags) {
-    FILE *f = NULL;
+void f_alloc_stats_get (struct f_alloc_stats *stats) {
+    unsigned long *from = (unsigned long *) &_astats;
+    unsigned long *to = (unsigned long *) stats;
+    for (size_t i = 0; i < sizeof (_astats) / sizeof (long); i++)
+        to[i] = __atomic_load_n (&from[i], __ATOMIC_RELAXED);
+}
 
-    const char *filename = NULL;
-    bool is_err = false;
-    bool i_die = ! (flags & F_NODIE);
-    bool quiet = flags & F_QUIET;
-    bool utf8 = flags & F_UTF8;
-    char *mode;
-    char *mode_f = str (3 + 10 + 1); // max mode 3 long, including b, 10 for utf-8
+void f_alloc_stats_reset () {
+    unsigned long *p = (unsigned long *) &_astats;
+    for (size_t i = 0; i < sizeof (_astats) / sizeof (long); i++)
+        __atomic_store_n (&p[i], 0, __ATOMIC_RELAXED);
+}
 
-    if (flags & F_WRITE) {
-        mode = "writing";
-        strcpy (mode_f, "w");
-        filename = filespec;
-    }
-    else if (flags & F_READ_WRITE_NO_TRUNC) {
-        mode = "read-write, no create or truncate";
-        strcpy (mode_f, "r+");
-        filename = filespec;
-    }
-    else if (*filespec == '+') {
-        mode = "read-write, no create or truncate";
-        strcpy (mode_f, "r+");
-        filename = filespec + 1;
-    }
-    else if (
-            (*filespec == '<' && *(filespec+1) == '+') ||
-            (*filespec == '+' && *(filespec+1) == '<')
-        ) {
-        mode = "read-write, no create or truncate";
-        strcpy (mode_f, "r+");
-        filename = filespec + 2;
-    }
-    else if (flags & F_READ_WRITE_TRUNC) {
-        mode = "read-write, create or truncate";
-        strcpy (mode_f, "w+");
-        filename = filespec;
-    }
-    else if (
-            (*filespec == '>' && *(filespec+1) == '+') ||
-            (*filespec == '+' && *(filespec+1) == '>')
-        ) {
-        mode = "read-write, create or truncate";
-        strcpy (mode_f, "w+");
-        filename = filespec + 2;
-    }
-    else if (*filespec == '>' && *(filespec+1) == '>') {
-        mode = "appending";
-        strcpy (mode_f, "a");
-        filename = filespec + 2;
-    }
-    else if (*filespec == '>') {
-        mode = "writing";
-        strcpy (mode_f, "w");
-        filename = filespec + 1;
-    }
-    else if (flags & F_APPEND) {
-        mode = "appending";
-        strcpy (mode_f, "a");
-        filename = filespec;
-    }
-    else if (flags & F_READ) {
-        mode = "reading";
-        strcpy (mode_f, "r");
-        filename = filespec;
-    }
-    else if (*filespec == '<') {
-        mode = "reading";
-        strcpy (mode_f, "r");
-        filename = filespec + 1;
-    }
-    else {
-        mode = "reading";
-        strcpy (mode_f, "r");
-        filename = filespec;
+/* Plain fprintf, so that dumping doesn't allocate and change the numbers.
+ */
+void f_alloc_stats_dump (FILE *f) {
+    struct f_alloc_stats st;
+    f_alloc_stats_get (&st);
+    fprintf (f, "fish-util allocations:\n");
+    for (int i = 0; i < F_ALLOC_NUM_FUNCS; i++)
+        fprintf (f, "  %-10s %10lu calls %14lu bytes\n", ALLOC_FUNCS[i], st.calls[i], st.bytes[i]);
+    fprintf (f, "  outstanding %ld bytes (not counting plain free), peak %ld bytes\n", st.outstanding, st.outstanding_peak);
+    fprintf (f, "  sizes:\n");
+    for (int i = 0; i < F_ALLOC_HIST_BUCKETS; i++) {
+        if (!st.hist[i])
+            continue;
+        if (i == F_ALLOC_HIST_BUCKETS - 1)
+            fprintf (f, "    > %-8lu %10lu\n", 16ul << (i - 1), st.hist[i]);
+        else
+            fprintf (f, "    <= %-7lu %10lu\n", 16ul << i, st.hist[i]);
     }
+}
 
-    if (utf8) {
-        sprintf (mode_f, "%s,ccs=UTF-8", mode_f); // NO space after comma, before is ok
-    }
+bool f_alloc_stats_enabled () {
+    return _alloc_stats;
+}
 
-    if (f_test_d (filename)) {
-        _ ();
-        Y (filename);
-        iwarn ("File %s is a directory (can't open)", _s);
-        is_err = true;
-    }
-    else {
-        f = fopen (filename, mode_f);
-        if (!f) {
-            int en = errno;
-            is_err = true;
-            if (!quiet) {
-                _ ();
-                Y (filename);
-                CY (mode);
-                errno = en;
-                iwarn ("Couldn't open %s for %s: %s", _s, _t, perr ());
-            }
-        }
-    }
+/* Uniform in (0, 1], per thread (xorshift).
+ */
+static double _prof_rand () {
+    if (!_prof_seed)
+        _prof_seed = (unsigned long) &_prof_seed ^ (unsigned long) time (NULL) ^ 0x9E3779B97F4A7C15ul;
+    _prof_seed ^= _prof_seed << 13;
+    _prof_seed ^= _prof_seed >> 7;
+    _prof_seed ^= _prof_seed << 17;
+    return ((_prof_seed >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
 
-    free (mode_f);
+/* Exponentially distributed gaps with mean _prof_rate, so that
+ * allocation patterns can't line up with the sampling.
+ */
+static long _prof_next_gap () {
+    return (long) (-log (_prof_rand ()) * _prof_rate_get ()) + 1;
+}
 
-    if (is_err) {
-        if (i_die) {
-            exit (1);
+static void _prof_lock_ () {
+    while (__atomic_test_and_set (&_prof_lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void _prof_unlock_ () {
+    __atomic_clear (&_prof_lock, __ATOMIC_RELEASE);
+}
+
+static void _prof_record (size_t size, void **frames, int depth) {
+    unsigned long hash = 14695981039346656037ul;
+    for (int i = 0; i < depth; i++) {
+        hash ^= (unsigned long) frames[i];
+        hash *= 1099511628211ul;
+    }
+    long rate = _prof_rate_get ();
+    // bytes this sample stands for, see the pprof docs.
+    double est = !size ? 0 : size >= (size_t) rate * 50 ? size : size / (1 - exp (- (double) size / rate));
+
+    _prof_lock_ ();
+    if (!_prof_table) {
+        _prof_unlock_ ();
+        return;
+    }
+    int idx = hash % PROF_TABLE_SIZE;
+    for (int i = 0; i < PROF_TABLE_SIZE; i++) {
+        struct prof_entry *e = &_prof_table[idx];
+        if (!e->depth) {
+            e->hash = hash;
+            e->depth = depth;
+            memcpy (e->frames, frames, depth * sizeof (void *));
         }
-        else {
-            return NULL;
+        if (e->hash == hash && e->depth == depth && !memcmp (e->frames, frames, depth * sizeof (void *))) {
+            e->count++;
+            e->bytes += size;
+            e->est_bytes += est;
+            _prof_unlock_ ();
+            return;
         }
+        idx = (idx + 1) % PROF_TABLE_SIZE;
     }
-    return f;
+    _prof_dropped++;
+    _prof_unlock_ ();
 }
 
-FILE *safeopen (const char *filespec) {
-    return safeopen_f (filespec, 0);
+static long _prof_rate_get () {
+    return __atomic_load_n (&_prof_rate, __ATOMIC_RELAXED);
 }
 
-// generic n XX
-// make global XX
-void _static_strings_save_restore (int which) {
-    if (! _static_str_initted) return;
-
-    static char *saves, *savet, *saveu, *savev, *savew;
-    static bool saved = false;
-    if (which == 0) {
-        saves = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-        savet = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-        saveu = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-        savev = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-        savew = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-        memcpy (saves, _s, STATIC_STR_LENGTH);
-        memcpy (savet, _t, STATIC_STR_LENGTH);
-        memcpy (saveu, _u, STATIC_STR_LENGTH);
-        memcpy (savev, _v, STATIC_STR_LENGTH);
-        memcpy (savew, _w, STATIC_STR_LENGTH);
+/* caller is the return address of the public entry point: the stack is
+ * recorded from the frame it's in. If it can't be found (no frame
+ * pointers, say), only _prof_sample itself is dropped.
+ */
+static void _prof_sample (size_t size, void *caller) {
+    if (_prof_busy)
+        return;
+    _prof_left -= size;
+    if (_prof_left > 0)
+        return;
+
+    _prof_busy = true;
+    _prof_left = _prof_next_gap ();
+    void *frames[PROF_MAX_DEPTH + PROF_SKIP_FRAMES];
+    int depth = backtrace (frames, PROF_MAX_DEPTH + PROF_SKIP_FRAMES);
+    int skip = 1;
+    for (int i = 1; i < depth && i <= PROF_SKIP_FRAMES; i++)
+        if (frames[i] == caller) {
+            skip = i;
+            break;
+        }
+    if (depth - skip > PROF_MAX_DEPTH)
+        depth = skip + PROF_MAX_DEPTH;
+    if (depth > skip)
+        _prof_record (size, frames + skip, depth - skip);
+    _prof_busy = false;
+}
 
-        saved = true;
+/* Sample on average once every sample_bytes bytes allocated through the
+ * f_malloc family and the pool. Restarting keeps the table; see
+ * f_heap_profile_reset.
+ */
+void f_heap_profile_start (long sample_bytes) {
+    if (sample_bytes <= 0) {
+        iwarn ("f_heap_profile_start: sample_bytes must be > 0");
+        return;
     }
-    else { // restore
-        if (!saved) return;
-
-        memcpy (_s, saves, STATIC_STR_LENGTH);
-        memcpy (_t, savet, STATIC_STR_LENGTH);
-        memcpy (_u, saveu, STATIC_STR_LENGTH);
-        memcpy (_v, savev, STATIC_STR_LENGTH);
-        memcpy (_w, savew, STATIC_STR_LENGTH);
+    _prof_lock_ ();
+    if (!_prof_table)
+        _prof_table = calloc (PROF_TABLE_SIZE, sizeof (struct prof_entry));
+    _prof_unlock_ ();
+    if (!_prof_table)
+        oom_fatal ();
 
-        saved = false;
-    }
+    // prime backtrace, whose first call can allocate.
+    void *frame;
+    backtrace (&frame, 1);
 
+    __atomic_store_n (&_prof_rate, sample_bytes, __ATOMIC_RELAXED);
 }
 
-void _static_strings_restore () {
-    _static_strings_save_restore (1);
+void f_heap_profile_stop () {
+    __atomic_store_n (&_prof_rate, 0, __ATOMIC_RELAXED);
 }
 
-void _static_strings_save () {
-    _static_strings_save_restore (0);
+void f_heap_profile_reset () {
+    _prof_lock_ ();
+    if (_prof_table)
+        memset (_prof_table, 0, PROF_TABLE_SIZE * sizeof (struct prof_entry));
+    _prof_dropped = 0;
+    _prof_unlock_ ();
 }
 
-/* Caller should free.
+/* Function name from a backtrace_symbols line, e.g.
+ * ./prog(main+0x1a) [0x55d4c1e1a1b9]
+ * Falls back to the address.
  */
-char *f_get_warn_prefix (const char *file, int line) {
-    _static_strings_save ();
+static void _prof_frame_name (const char *sym, void *addr, char *buf, int len) {
+    const char *a = sym ? strchr (sym, '(') : NULL;
+    const char *b = a ? strpbrk (a, "+)") : NULL;
+    if (a && b && b > a + 1)
+        snprintf (buf, len, "%.*s", (int) (b - a - 1), a + 1);
+    else
+        snprintf (buf, len, "%p", addr);
+}
 
-    _ ();
-    spr ("%d", line);
-    Y (_s);
+/* Sorted heaviest first.
+ */
+static int _prof_cmp (const void *a, const void *b) {
+    double x = ((const struct prof_entry *) a)->est_bytes;
+    double y = ((const struct prof_entry *) b)->est_bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
 
-    int len = strlen (file) + 1 + strlen (_t) + 1 + 1;
-    char *warn_prefix = f_malloc (len * sizeof (char));
+/* F_HEAP_PROFILE_PPROF: legacy pprof heap profile (heap_v2). Frees aren't
+ * seen, so in-use and allocated are the same. The sampled counts are
+ * written; pprof scales them using the rate in the header.
+ *
+ * F_HEAP_PROFILE_COLLAPSED: one 'root;...;leaf bytes' line per stack, bytes
+ * already scaled, for flamegraph.pl and friends.
+ */
+bool f_heap_profile_write (FILE *f, int flags) {
+    if (!_prof_table) {
+        iwarn ("f_heap_profile_write: profiler not started");
+        return false;
+    }
 
-    sprintf (warn_prefix, "%s:%s", file, _t);
+    bool busy = _prof_busy;
+    _prof_busy = true;
 
-    _static_strings_restore ();
+    struct prof_entry *entries = malloc (PROF_TABLE_SIZE * sizeof (struct prof_entry));
+    if (!entries)
+        oom_fatal ();
+    int n = 0;
+    long count = 0, bytes = 0;
+    _prof_lock_ ();
+    for (int i = 0; i < PROF_TABLE_SIZE; i++) {
+        if (!_prof_table[i].depth)
+            continue;
+        entries[n++] = _prof_table[i];
+        count += _prof_table[i].count;
+        bytes += _prof_table[i].bytes;
+    }
+    long dropped = _prof_dropped;
+    _prof_unlock_ ();
+    qsort (entries, n, sizeof (struct prof_entry), _prof_cmp);
+
+    if (flags & F_HEAP_PROFILE_COLLAPSED) {
+        for (int i = 0; i < n; i++) {
+            struct prof_entry *e = &entries[i];
+            char **syms = backtrace_symbols (e->frames, e->depth);
+            char name[200];
+            for (int j = e->depth - 1; j >= 0; j--) {
+                _prof_frame_name (syms ? syms[j] : NULL, e->frames[j], name, sizeof (name));
+                fprintf (f, j ? "%s;" : "%s", name);
+            }
+            fprintf (f, " %.0f\n", e->est_bytes);
+            free (syms);
+        }
+    }
+    else {
+        fprintf (f, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%ld\n", count, bytes, count, bytes, _prof_rate_get ());
+        for (int i = 0; i < n; i++) {
+            struct prof_entry *e = &entries[i];
+            fprintf (f, "%6ld: %8ld [%6ld: %8ld] @", e->count, e->bytes, e->count, e->bytes);
+            for (int j = 0; j < e->depth; j++)
+                fprintf (f, " %p", e->frames[j]);
+            fprintf (f, "\n");
+        }
+        fprintf (f, "\nMAPPED_LIBRARIES:\n");
+        FILE *maps = fopen ("/proc/self/maps", "r");
+        if (maps) {
+            char buf[4096];
+            size_t num;
+            while ((num = fread (buf, 1, sizeof (buf), maps)))
+                fwrite (buf, 1, num, f);
+            fclose (maps);
+        }
+    }
+    free (entries);
+    _prof_busy = busy;
 
-    return warn_prefix;
+    if (dropped)
+        warn ("Heap profile: %ld samples dropped (table full)", dropped);
+    return true;
 }
 
+static int _pool_class (size_t size) {
+    size_t block = POOL_MIN_BLOCK;
+    for (int i = 0; i < F_POOL_NUM_CLASSES; i++) {
+        if (size + POOL_HDR <= block)
+            return i;
+        block <<= 1;
+    }
+    return -1;
+}
 
-bool f_test_f (const char *file) {
-    struct stat *s = f_stat_f (file, F_QUIET);
-    if (!s)
-        return false;
-    int mode = s->st_mode;
-    if (!mode)
-        return false;
+static void _pool_thread_exit (void *slabs) {
+    (void) slabs;
+    _pool_release ();
+}
 
-    return S_ISREG (mode);
+static void _pool_key_init () {
+    pthread_key_create (&_pool_key, _pool_thread_exit);
 }
 
-bool f_test_d (const char *file) {
-    struct stat *s = f_stat_f (file, F_QUIET);
-    if (!s)
-        return false;
-    int mode = s->st_mode;
-    if (!mode)
-        return false;
+/* Carve a new slab into blocks of class cls and put them on the free list.
+ */
+static void _pool_refill (int cls) {
+    pthread_once (&_pool_once, _pool_key_init);
+    size_t block = POOL_MIN_BLOCK << cls;
+    /* Not f_malloc: the profiler samples the blocks as they're handed out,
+     * not the slab as well.
+     */
+    char *slab = malloc (POOL_SLAB_SIZE);
+    if (!slab)
+        oom_fatal ();
+    if (_alloc_stats)
+        _alloc_account (F_ALLOC_MALLOC, POOL_SLAB_SIZE, slab);
+    // first block holds the slab chain.
+    *(void **) slab = _pool_slabs;
+    _pool_slabs = slab;
+    // also re-arms it if another key's destructor used the pool.
+    pthread_setspecific (_pool_key, slab);
+    for (char *b = slab + block; b + block <= slab + POOL_SLAB_SIZE; b += block) {
+        *(void **) b = _pool_lists[cls];
+        _pool_lists[cls] = b;
+        _pool_stats[cls].free++;
+    }
+    _pool_stats[cls].slabs++;
+}
 
-    return S_ISDIR (mode);
+/* Small blocks come from the calling thread's free lists if the pool was
+ * switched on at init time, else from malloc. Either way the block has to
+ * be given back with f_pool_free, not free.
+ */
+static void *_f_pool_malloc (size_t size, void *caller) {
+    int cls = _pool_enabled ? _pool_class (size) : -1;
+    unsigned char *b;
+    if (cls == -1) {
+        b = _f_malloc (size + POOL_HDR, caller);
+        *b = POOL_CLASS_NONE;
+        return b + POOL_HDR;
+    }
+    if (!_pool_lists[cls])
+        _pool_refill (cls);
+    b = _pool_lists[cls];
+    _pool_lists[cls] = *(void **) b;
+    *b = cls;
+    _pool_stats[cls].allocs++;
+    if (_prof_rate_get ())
+        _prof_sample (size, caller);
+    _pool_stats[cls].free--;
+    _pool_stats[cls].in_use++;
+    return b + POOL_HDR;
 }
 
-/* Take from the heap, probably slower than normal stat.
+__attribute__ ((noinline)) void *f_pool_malloc (size_t size) {
+    return _f_pool_malloc (size, __builtin_return_address (0));
+}
+
+void f_pool_free (void *ptr) {
+    if (!ptr)
+        return;
+    unsigned char *b = (unsigned char *) ptr - POOL_HDR;
+    int cls = *b;
+    if (cls == POOL_CLASS_NONE) {
+        f_free (b);
+        return;
+    }
+    *(void **) b = _pool_lists[cls];
+    _pool_lists[cls] = b;
+    _pool_stats[cls].frees++;
+    _pool_stats[cls].free++;
+    _pool_stats[cls].in_use--;
+}
+
+/* Like str: all nulls, length includes \0.
+ * Free with f_pool_free.
  */
-struct stat *f_stat_f (const char *file, int flags) {
-    if (!mystat_initted) {
-        mystat = f_mallocv (*mystat);
-        mystat_initted = true;
+__attribute__ ((noinline)) char *f_pool_str (int length) {
+    assert (length > 0);
+    char *s = _f_pool_malloc (length * sizeof (char), __builtin_return_address (0));
+    memset (s, '\0', length);
+    return s;
+}
+
+/* Stats are for the calling thread.
+ * Returns the number of classes filled in.
+ */
+int f_pool_get_stats (struct f_pool_stats *stats) {
+    size_t block = POOL_MIN_BLOCK;
+    for (int i = 0; i < F_POOL_NUM_CLASSES; i++) {
+        stats[i] = _pool_stats[i];
+        stats[i].size = block - POOL_HDR;
+        block <<= 1;
     }
-    memset (mystat, 0, sizeof (*mystat));
+    return F_POOL_NUM_CLASSES;
+}
 
-    bool quiet = flags & F_QUIET;
+bool f_pool_enabled () {
+    return _pool_enabled;
+}
 
-    if (-1 == stat (file, mystat)) {
-        int en = errno;
-        if (!quiet) {
-            _ ();
-            Y (file);
-            errno = en;
-            warn_perr ("Couldn't stat %s: %s", _s);
-        }
-        return NULL;
+/* Give the calling thread's slabs back to malloc.
+ * Only safe when none of its blocks are still in use.
+ */
+static void _pool_release () {
+    void *slab = _pool_slabs;
+    while (slab) {
+        void *next = *(void **) slab;
+        f_free (slab);
+        slab = next;
     }
-    return mystat;
+    if (_pool_slabs)
+        pthread_setspecific (_pool_key, NULL);
+    _pool_slabs = NULL;
+    memset (_pool_lists, 0, sizeof (_pool_lists));
+    memset (_pool_stats, 0, sizeof (_pool_stats));
 }
 
-struct stat *f_stat (const char *file) {
-    return f_stat_f (file, 0);
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct f_arena {
+    struct arena_block *blocks;
+    size_t block_size;
+};
+
+/* block_size 0 means the default (64k).
+ * Not thread-safe.
+ */
+f_arena *f_arena_new (size_t block_size) {
+    f_arena *a = f_malloc (sizeof (f_arena));
+    a->blocks = NULL;
+    a->block_size = block_size ? block_size : ARENA_BLOCK_DEFAULT;
+    return a;
 }
 
-void f_disable_colors () {
-    _disable_colors = 1;
+static struct arena_block *_arena_block_new (size_t size) {
+    struct arena_block *b = f_malloc (sizeof (struct arena_block) + size);
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
 }
 
-/* String with all nulls (can't use strlen).
- * length includes \0.
- * Caller should free.
+/* Don't free the result; it goes with f_arena_reset or f_arena_destroy.
  */
-char *str (int length) {
-    assert (length > 0);
-    char *s = f_malloc (length * sizeof (char));
-    memset (s, '\0', length);
-    return s;
+void *f_arena_alloc (f_arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~ (size_t) (ARENA_ALIGN - 1);
+    struct arena_block *b = a->blocks;
+    if (b && b->size - b->used >= size) {
+        void *ptr = b->data + b->used;
+        b->used += size;
+        return ptr;
+    }
+    /* Too big for a normal block: give it its own, behind the current one
+     * so that the rest of the current one still gets used.
+     */
+    if (size > a->block_size / 4 && b) {
+        struct arena_block *big = _arena_block_new (size);
+        big->used = size;
+        big->next = b->next;
+        b->next = big;
+        return big->data;
+    }
+    b = _arena_block_new (size > a->block_size ? size : a->block_size);
+    b->next = a->blocks;
+    a->blocks = b;
+    b->used = size;
+    return b->data;
 }
 
-/* Is null-terminated, even if size too small.
+char *f_arena_strdup (f_arena *a, const char *s) {
+    size_t len = strlen (s);
+    char *ret = f_arena_alloc (a, len + 1);
+    memcpy (ret, s, len + 1);
+    return ret;
+}
+
+/* Keeps the newest block.
  */
-void spr (const char *format, ...) {
-    int size = STATIC_STR_LENGTH; // with \0
-    char *s = str (size); // \0
-    va_list arglist;
-    va_start ( arglist, format );
-    vsnprintf (s, size, format, arglist);
-    va_end ( arglist );
+void f_arena_reset (f_arena *a) {
+    if (!a->blocks)
+        return;
+    struct arena_block *b = a->blocks->next;
+    while (b) {
+        struct arena_block *next = b->next;
+        f_free (b);
+        b = next;
+    }
+    a->blocks->next = NULL;
+    a->blocks->used = 0;
+}
 
-    int l = strlen (s);
-    if (l > STATIC_STR_LENGTH - 1) {
-        warn ("static string truncated (%s)", s);
-        l = STATIC_STR_LENGTH - 1;
+void f_arena_destroy (f_arena *a) {
+    f_arena_reset (a);
+    f_free (a->blocks);
+    f_free (a);
+}
+
+/* Starts out in the inline buffer, so short strings need no allocation.
+ */
+void f_strbuf_init (f_strbuf *b) {
+    b->buf = b->inline_buf;
+    b->cap = F_STRBUF_INLINE;
+    b->len = 0;
+    b->arena = NULL;
+    *b->buf = '\0';
+}
+
+/* Grows into the arena instead of the heap; f_strbuf_free is then a no-op.
+ */
+void f_strbuf_init_arena (f_strbuf *b, f_arena *a) {
+    f_strbuf_init (b);
+    b->arena = a;
+}
+
+/* Room for extra more chars and the \0.
+ * Doubles, so appends are amortized O(1).
+ */
+void f_strbuf_reserve (f_strbuf *b, size_t extra) {
+    size_t need = b->len + extra + 1;
+    if (need <= b->cap)
+        return;
+    size_t cap = b->cap * 2;
+    while (cap < need)
+        cap *= 2;
+    if (b->arena) {
+        char *new = f_arena_alloc (b->arena, cap);
+        memcpy (new, b->buf, b->len + 1);
+        b->buf = new;
     }
-    char **ptr = _get_static_str_ptr ();
-    memcpy (*ptr, s, l + 1);
-    free (s);
+    else if (b->buf == b->inline_buf) {
+        char *new = f_malloc (cap);
+        memcpy (new, b->buf, b->len + 1);
+        b->buf = new;
+    }
+    else
+        b->buf = f_realloc (b->buf, cap);
+    b->cap = cap;
 }
 
-/* Caller should free.
+void f_strbuf_append_n (f_strbuf *b, const char *s, size_t n) {
+    f_strbuf_reserve (b, n);
+    memcpy (b->buf + b->len, s, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+}
+
+void f_strbuf_append (f_strbuf *b, const char *s) {
+    f_strbuf_append_n (b, s, strlen (s));
+}
+
+void f_strbuf_append_c (f_strbuf *b, char c) {
+    f_strbuf_reserve (b, 1);
+    b->buf[b->len++] = c;
+    b->buf[b->len] = '\0';
+}
+
+/* Formats straight into the free space; only if that's too small does it
+ * grow to the exact size and format again.
+ * Returns the number of chars appended, or -1 on a format error.
  */
-char *spr_ (const char *format, int size /*with null*/, ...) {
-    char *s = str (size);
+int f_strbuf_vappendf (f_strbuf *b, const char *format, va_list arglist) {
+    va_list arglist_copy;
+    va_copy (arglist_copy, arglist);
+    size_t avail = b->cap - b->len;
+    int rc = vsnprintf (b->buf + b->len, avail, format, arglist);
+    if (rc >= 0 && (size_t) rc >= avail) {
+        f_strbuf_reserve (b, rc);
+        vsnprintf (b->buf + b->len, rc + 1, format, arglist_copy);
+    }
+    va_end (arglist_copy);
+    if (rc < 0) {
+        b->buf[b->len] = '\0';
+        return -1;
+    }
+    b->len += rc;
+    return rc;
+}
+
+int f_strbuf_appendf (f_strbuf *b, const char *format, ...) {
     va_list arglist;
-    va_start ( arglist, size );
-    vsnprintf (s, size, format, arglist);
-    va_end ( arglist );
-    return s;
+    va_start (arglist, format);
+    int rc = f_strbuf_vappendf (b, format, arglist);
+    va_end (arglist);
+    return rc;
 }
 
-void _ () {
-    if (! _static_str_initted) {
-        _static_str_init ();
-        _static_str_initted = true;
+/* len not more than the current length.
+ */
+void f_strbuf_truncate (f_strbuf *b, size_t len) {
+    if (len > b->len)
+        piepr;
+    b->len = len;
+    b->buf[len] = '\0';
+}
+
+void f_strbuf_reset (f_strbuf *b) {
+    f_strbuf_truncate (b, 0);
+}
+
+/* Caller should free the result (with free or f_free). b is empty
+ * afterwards.
+ */
+char *f_strbuf_detach (f_strbuf *b) {
+    char *ret;
+    if (b->buf == b->inline_buf || b->arena)
+        ret = f_strndup (b->buf, b->len);
+    else
+        ret = b->buf;
+    f_arena *a = b->arena;
+    f_strbuf_init (b);
+    b->arena = a;
+    return ret;
+}
+
+void f_strbuf_free (f_strbuf *b) {
+    if (b->buf != b->inline_buf && !b->arena)
+        f_free (b->buf);
+    f_arena *a = b->arena;
+    f_strbuf_init (b);
+    b->arena = a;
+}
+
+static size_t _big_round (size_t size) {
+    return (size + BIG_HDR + BIG_PAGE - 1) & ~ (size_t) (BIG_PAGE - 1);
+}
+
+/* Fault in [p, p + len) now rather than on first touch.
+ */
+static void _big_populate (char *p, size_t len) {
+#ifdef MADV_POPULATE_WRITE
+    if (!madvise (p, len, MADV_POPULATE_WRITE))
+        return;
+#endif
+    long page = sysconf (_SC_PAGESIZE);
+    for (size_t i = 0; i < len; i += page)
+        ((volatile char *) p)[i] = 0;
+}
+
+/* len bytes at a huge page aligned address, or NULL.
+ * Maps an extra huge page and trims.
+ */
+static char *_big_map (size_t len) {
+    char *raw = mmap (NULL, len + BIG_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *p = (char *) (((unsigned long) raw + BIG_PAGE - 1) & ~ (unsigned long) (BIG_PAGE - 1));
+    if (p > raw)
+        munmap (raw, p - raw);
+    if (raw + len + BIG_PAGE > p + len)
+        munmap (p + len, raw + len + BIG_PAGE - (p + len));
+    return p;
+}
+
+/* For buffers of several MB: mmap'ed, with MADV_HUGEPAGE, and grown with
+ * mremap instead of copying. F_BIG_POPULATE pre-faults the pages.
+ * Returns NULL with errno set on failure. Free with f_big_free.
+ */
+void *f_big_alloc (size_t size, int flags) {
+    size_t len = _big_round (size);
+    char *p = _big_map (len);
+    if (!p)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise (p, len, MADV_HUGEPAGE);
+#endif
+    if (flags & F_BIG_POPULATE)
+        _big_populate (p, len);
+    *(size_t *) p = len;
+    return p + BIG_HDR;
+}
+
+/* Contents are kept, like realloc. NULL ptr means f_big_alloc.
+ * On failure returns NULL and ptr is untouched.
+ */
+void *f_big_realloc (void *ptr, size_t size, int flags) {
+    if (!ptr)
+        return f_big_alloc (size, flags);
+    char *p = (char *) ptr - BIG_HDR;
+    size_t old = *(size_t *) p;
+    size_t len = _big_round (size);
+    if (len == old)
+        return ptr;
+    /* In place if we can. Otherwise plain MREMAP_MAYMOVE could put it
+     * anywhere and lose the huge page alignment, so move the pages (still
+     * no copying) onto a fresh aligned mapping.
+     */
+    char *new = mremap (p, old, len, 0);
+    if (new == MAP_FAILED) {
+        char *to = _big_map (len);
+        if (!to)
+            return NULL;
+        new = mremap (p, old, len, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+        if (new == MAP_FAILED) {
+            int en = errno;
+            munmap (to, len);
+            errno = en;
+            return NULL;
+        }
+    }
+    if (len > old) {
+#ifdef MADV_HUGEPAGE
+        madvise (new + old, len - old, MADV_HUGEPAGE);
+#endif
+        if (flags & F_BIG_POPULATE)
+            _big_populate (new + old, len - old);
     }
+    *(size_t *) new = len;
+    return new + BIG_HDR;
+}
 
-    _static_str_idx = -1;
-    for (int i = 0; i < NUM_STATIC_STRINGS; i++) {
-        memset (*_static_strs[i], '\0', STATIC_STR_LENGTH);
+void f_big_free (void *ptr) {
+    if (!ptr)
+        return;
+    char *p = (char *) ptr - BIG_HDR;
+    munmap (p, *(size_t *) p);
+}
+
+/* Usable size.
+ */
+size_t f_big_size (void *ptr) {
+    return *(size_t *) ((char *) ptr - BIG_HDR) - BIG_HDR;
+}
+
+/* For the library's own growing buffers (vec): from threshold bytes on,
+ * use f_big_alloc with these flags. 0 turns it off.
+ */
+void f_big_config (size_t threshold, int flags) {
+    _big_threshold = threshold;
+    _big_flags = flags;
+}
+
+size_t f_big_threshold () {
+    return _big_threshold;
+}
+
+int f_big_flags () {
+    return _big_flags;
+}
+
+static unsigned long _intern_hash (const char *s, size_t len) {
+    unsigned long hash = 14695981039346656037ul;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 1099511628211ul;
     }
+    return hash;
 }
 
-char *R_ (const char *s) {
-    return _color (s, RED);
+/* Slot of the entry, or of the empty slot where it would go.
+ */
+static struct intern_entry **_intern_probe (struct intern_table *t, const char *s, size_t len, unsigned long hash) {
+    size_t mask = t->size - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct intern_entry **slot = &t->slots[i];
+        struct intern_entry *e = __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+        if (!e)
+            return slot;
+        if (e->hash == hash && e->len == len && !memcmp (e->str, s, len))
+            return slot;
+    }
 }
-char *BR_ (const char *s) {
-    return _color (s, BRIGHT_RED);
+
+static struct intern_table *_intern_table_new (size_t size) {
+    struct intern_table *t = f_malloc (sizeof (struct intern_table));
+    t->size = size;
+    t->slots = f_calloc (size, sizeof (struct intern_entry *));
+    t->prev = NULL;
+    return t;
 }
-char *G_ (const char *s) {
-    return _color (s, GREEN);
+
+// with the lock held.
+static void _intern_grow () {
+    struct intern_table *old = _intern_table;
+    struct intern_table *t = _intern_table_new (old->size * 2);
+    for (size_t i = 0; i < old->size; i++) {
+        struct intern_entry *e = old->slots[i];
+        if (e)
+            *_intern_probe (t, e->str, e->len, e->hash) = e;
+    }
+    t->prev = old;
+    __atomic_store_n (&_intern_table, t, __ATOMIC_RELEASE);
 }
-char *BG_ (const char *s) {
-    return _color (s, BRIGHT_GREEN);
+
+/* Returns the canonical copy of the first len chars of s, so interned
+ * strings can be compared with ==. Don't free it; it lives until
+ * fish_util_cleanup.
+ * Safe to call from several threads.
+ */
+const char *f_intern_n (const char *s, size_t len) {
+    unsigned long hash = _intern_hash (s, len);
+    struct intern_table *t = __atomic_load_n (&_intern_table, __ATOMIC_ACQUIRE);
+    if (t) {
+        struct intern_entry *e = __atomic_load_n (_intern_probe (t, s, len, hash), __ATOMIC_ACQUIRE);
+        if (e)
+            return e->str;
+    }
+
+    pthread_mutex_lock (&_intern_lock);
+    if (!_intern_table) {
+        _intern_arena = f_arena_new (0);
+        __atomic_store_n (&_intern_table, _intern_table_new (INTERN_SIZE_INIT), __ATOMIC_RELEASE);
+    }
+    struct intern_entry **slot = _intern_probe (_intern_table, s, len, hash);
+    struct intern_entry *e = *slot;
+    if (!e) {
+        e = f_arena_alloc (_intern_arena, sizeof (struct intern_entry) + len + 1);
+        e->hash = hash;
+        e->len = len;
+        memcpy (e->str, s, len);
+        e->str[len] = '\0';
+        __atomic_store_n (slot, e, __ATOMIC_RELEASE);
+        // keep the table at most half full.
+        if (__atomic_add_fetch (&_intern_count, 1, __ATOMIC_RELAXED) * 2 > _intern_table->size)
+            _intern_grow ();
+    }
+    pthread_mutex_unlock (&_intern_lock);
+    return e->str;
 }
-char *Y_ (const char *s) {
-    return _color (s, YELLOW);
+
+const char *f_intern (const char *s) {
+    return f_intern_n (s, strlen (s));
 }
-char *BY_ (const char *s) {
-    return _color (s, BRIGHT_YELLOW);
+
+/* The canonical copy if s has been interned, else NULL.
+ */
+const char *f_intern_lookup (const char *s) {
+    struct intern_table *t = __atomic_load_n (&_intern_table, __ATOMIC_ACQUIRE);
+    if (!t)
+        return NULL;
+    size_t len = strlen (s);
+    struct intern_entry *e = __atomic_load_n (_intern_probe (t, s, len, _intern_hash (s, len)), __ATOMIC_ACQUIRE);
+    return e ? e->str : NULL;
 }
-char *B_ (const char *s) {
-    return _color (s, BLUE);
+
+size_t f_intern_count () {
+    return __atomic_load_n (&_intern_count, __ATOMIC_RELAXED);
 }
-char *BB_ (const char *s) {
-    return _color (s, BRIGHT_BLUE);
+
+/* Not while other threads are still using the table.
+ */
+static void _intern_free () {
+    pthread_mutex_lock (&_intern_lock);
+    struct intern_table *t = _intern_table;
+    while (t) {
+        struct intern_table *prev = t->prev;
+        f_free (t->slots);
+        f_free (t);
+        t = prev;
+    }
+    if (_intern_arena)
+        f_arena_destroy (_intern_arena);
+    __atomic_store_n (&_intern_table, NULL, __ATOMIC_RELEASE);
+    _intern_arena = NULL;
+    __atomic_store_n (&_intern_count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&_intern_lock);
 }
-char *CY_ (const char *s) {
-    return _color (s, CYAN);
+
+/* init not necessary, unless you want to start over after having called
+ * _cleanup. (And even then it's not (currently) necessary).
+ */
+void fish_util_init () {
+    fish_util_init_f (0);
 }
-char *BCY_ (const char *s) {
-    return _color (s, BRIGHT_CYAN);
+
+/* F_POOL: take the library's own small temporary strings from a
+ * thread-local pool instead of malloc. Should be set before the library is
+ * used.
+ *
+ * F_ALLOC_STATS: count calls, bytes and sizes going through the f_malloc
+ * family, and dump them to stderr in fish_util_cleanup. With F_QUIET, only
+ * count (see f_alloc_stats_get).
+ */
+void fish_util_init_f (int flags) {
+    _pool_enabled = flags & F_POOL;
+    _alloc_stats = flags & F_ALLOC_STATS;
+    _alloc_stats_dump = _alloc_stats && ! (flags & F_QUIET);
+    _static_str_ensure ();
 }
-char *M_ (const char *s) {
-    return _color (s, MAGENTA);
+
+/* Frees the static strings of the calling thread only; other threads' go
+ * when they exit.
+ */
+void fish_util_cleanup () {
+    _sites_report ();
+    f_out_flush ();
+    _static_strings_free ();
+    _pool_release ();
+    _intern_free ();
+    _path_cache_free ();
+    f_sys_coproc_stop ();
+    if (mystat_initted) {
+        f_free (mystat);
+        mystat_initted = false;
+    }
+    if (_alloc_stats_dump)
+        f_alloc_stats_dump (stderr);
 }
-char *BM_ (const char *s) {
-    return _color (s, BRIGHT_MAGENTA);
+
+/* Caller shouldn't free.
+ */
+FILE *safeopen_f (const char *filespec, int flags) {
+    FILE *f = NULL;
+
+    const char *filename = NULL;
+    bool is_err = false;
+    bool i_die = ! (flags & F_NODIE);
+    bool quiet = flags & F_QUIET;
+    bool utf8 = flags & F_UTF8;
+    char *mode;
+    char *mode_f = f_pool_str (3 + 10 + 1); // max mode 3 long, including b, 10 for utf-8
+
+    if (flags & F_WRITE) {
+        mode = "writing";
+        strcpy (mode_f, "w");
+        filename = filespec;
+    }
+    else if (flags & F_READ_WRITE_NO_TRUNC) {
+        mode = "read-write, no create or truncate";
+        strcpy (mode_f, "r+");
+        filename = filespec;
+    }
+    else if (*filespec == '+') {
+        mode = "read-write, no create or truncate";
+        strcpy (mode_f, "r+");
+        filename = filespec + 1;
+    }
+    else if (
+            (*filespec == '<' && *(filespec+1) == '+') ||
+            (*filespec == '+' && *(filespec+1) == '<')
+        ) {
+        mode = "read-write, no create or truncate";
+        strcpy (mode_f, "r+");
+        filename = filespec + 2;
+    }
+    else if (flags & F_READ_WRITE_TRUNC) {
+        mode = "read-write, create or truncate";
+        strcpy (mode_f, "w+");
+        filename = filespec;
+    }
+    else if (
+            (*filespec == '>' && *(filespec+1) == '+') ||
+            (*filespec == '+' && *(filespec+1) == '>')
+        ) {
+        mode = "read-write, create or truncate";
+        strcpy (mode_f, "w+");
+        filename = filespec + 2;
+    }
+    else if (*filespec == '>' && *(filespec+1) == '>') {
+        mode = "appending";
+        strcpy (mode_f, "a");
+        filename = filespec + 2;
+    }
+    else if (*filespec == '>') {
+        mode = "writing";
+        strcpy (mode_f, "w");
+        filename = filespec + 1;
+    }
+    else if (flags & F_APPEND) {
+        mode = "appending";
+        strcpy (mode_f, "a");
+        filename = filespec;
+    }
+    else if (flags & F_READ) {
+        mode = "reading";
+        strcpy (mode_f, "r");
+        filename = filespec;
+    }
+    else if (*filespec == '<') {
+        mode = "reading";
+        strcpy (mode_f, "r");
+        filename = filespec + 1;
+    }
+    else {
+        mode = "reading";
+        strcpy (mode_f, "r");
+        filename = filespec;
+    }
+
+    if (utf8) {
+        strcat (mode_f, ",ccs=UTF-8"); // NO space after comma, before is ok
+    }
+
+    if (f_test_d (filename)) {
+        _ ();
+        Y (filename);
+        iwarn ("File %s is a directory (can't open)", _s);
+        is_err = true;
+    }
+    else {
+        f = fopen (filename, mode_f);
+        if (!f) {
+            int en = errno;
+            is_err = true;
+            if (!quiet) {
+                _ ();
+                Y (filename);
+                CY (mode);
+                errno = en;
+                iwarn ("Couldn't open %s for %s: %s", _s, _t, perr ());
+            }
+        }
+    }
+
+    f_pool_free (mode_f);
+
+    if (is_err) {
+        if (i_die) {
+            exit (1);
+        }
+        else {
+            return NULL;
+        }
+    }
+    return f;
+}
+
+FILE *safeopen (const char *filespec) {
+    return safeopen_f (filespec, 0);
+}
+
+// generic n XX
+// make global XX
+void _static_strings_save_restore (int which) {
+    if (! _static_str_initted) return;
+
+    static __thread char *saves, *savet, *saveu, *savev, *savew;
+    static __thread bool saved = false;
+    int len = _static_str_len;
+    if (which == 0) {
+        saves = f_pool_malloc (sizeof (char) * len);
+        savet = f_pool_malloc (sizeof (char) * len);
+        saveu = f_pool_malloc (sizeof (char) * len);
+        savev = f_pool_malloc (sizeof (char) * len);
+        savew = f_pool_malloc (sizeof (char) * len);
+        memcpy (saves, _s, len);
+        memcpy (savet, _t, len);
+        memcpy (saveu, _u, len);
+        memcpy (savev, _v, len);
+        memcpy (savew, _w, len);
+
+        saved = true;
+    }
+    else { // restore
+        if (!saved) return;
+
+        memcpy (_s, saves, len);
+        memcpy (_t, savet, len);
+        memcpy (_u, saveu, len);
+        memcpy (_v, savev, len);
+        memcpy (_w, savew, len);
+
+        f_pool_free (saves);
+        f_pool_free (savet);
+        f_pool_free (saveu);
+        f_pool_free (savev);
+        f_pool_free (savew);
+
+        saved = false;
+    }
+
+}
+
+void _static_strings_restore () {
+    _static_strings_save_restore (1);
+}
+
+void _static_strings_save () {
+    _static_strings_save_restore (0);
+}
+
+/* <file>:<line>, line in yellow if color.
+ */
+static void _warn_prefix_append (f_strbuf *b, const char *file, int line, bool color) {
+    f_strbuf_appendf (b, "%s:%s%d%s", file, color ? COL[F_COLOR_YELLOW] : "", line, color ? COL[0] : "");
+}
+
+/* Caller should free.
+ */
+char *f_get_warn_prefix (const char *file, int line) {
+    f_strbuf b;
+    f_strbuf_init (&b);
+    _warn_prefix_append (&b, file, line, _colors_on ());
+    char *warn_prefix = f_malloc (b.len + 1);
+    memcpy (warn_prefix, b.buf, b.len + 1);
+    f_strbuf_free (&b);
+    return warn_prefix;
+}
+
+static const char *_site_prefix_make (struct f_site *site, bool color) {
+    f_strbuf b;
+    f_strbuf_init (&b);
+    _warn_prefix_append (&b, site->file, site->line, color);
+    // lives as long as the site, i.e. forever: keep it out of the accounting.
+    char *ret = malloc (b.len + 1);
+    if (ret)
+        memcpy (ret, b.buf, b.len + 1);
+    f_strbuf_free (&b);
+    return ret ? ret : site->file;
+}
+
+/* The site's prefix, built once: the first caller builds it and any others
+ * wait for it.
+ */
+static const char *_site_prefix (struct f_site *site) {
+    int state = __atomic_load_n (&site->prefix_state, __ATOMIC_ACQUIRE);
+    if (state != 2) {
+        if (!state && __atomic_compare_exchange_n (&site->prefix_state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            site->prefix[0] = _site_prefix_make (site, false);
+            site->prefix[1] = _site_prefix_make (site, true);
+            __atomic_store_n (&site->prefix_state, 2, __ATOMIC_RELEASE);
+        }
+        else while (__atomic_load_n (&site->prefix_state, __ATOMIC_ACQUIRE) != 2)
+            sched_yield ();
+    }
+    return site->prefix[_colors_on () ? 1 : 0];
+}
+
+
+bool f_test_f (const char *file) {
+    struct stat *s = f_stat_f (file, F_QUIET);
+    if (!s)
+        return false;
+    int mode = s->st_mode;
+    if (!mode)
+        return false;
+
+    return S_ISREG (mode);
+}
+
+bool f_test_d (const char *file) {
+    struct stat *s = f_stat_f (file, F_QUIET);
+    if (!s)
+        return false;
+    int mode = s->st_mode;
+    if (!mode)
+        return false;
+
+    return S_ISDIR (mode);
+}
+
+/* Take from the heap, probably slower than normal stat.
+ */
+struct stat *f_stat_f (const char *file, int flags) {
+    if (!mystat_initted) {
+        mystat = f_mallocv (*mystat);
+        mystat_initted = true;
+    }
+    memset (mystat, 0, sizeof (*mystat));
+
+    bool quiet = flags & F_QUIET;
+
+    if (-1 == stat (file, mystat)) {
+        int en = errno;
+        if (!quiet) {
+            _ ();
+            Y (file);
+            errno = en;
+            warn_perr ("Couldn't stat %s: %s", _s);
+        }
+        return NULL;
+    }
+    return mystat;
+}
+
+struct stat *f_stat (const char *file) {
+    return f_stat_f (file, 0);
+}
+
+void f_disable_colors () {
+    _disable_colors = 1;
+}
+
+/* Escape for color, or NULL (with a warning) if it's not one of
+ * enum f_colors.
+ */
+static const char *_color_code (int color) {
+    if (color < 1 || color >= (int) (sizeof (COL) / sizeof (*COL))) {
+        iwarn ("Invalid color %d", color);
+        return NULL;
+    }
+    return COL[color];
+}
+
+/* Colors and whether stdout is a terminal are decided as in the other
+ * color functions, but nothing is allocated.
+ */
+
+/* Like snprintf: writes at most len bytes including the \0, and returns
+ * the length the whole thing needed (without \0). An invalid color gets
+ * a warning and s is used without color.
+ */
+int f_color_buf (char *buf, size_t len, const char *s, int color) {
+    const char *code = _colors_on () ? _color_code (color) : NULL;
+    const char *a = code ? code : "";
+    const char *b = code ? COL[0] : "";
+    size_t la = strlen (a), ls = strlen (s), lb = strlen (b);
+    size_t total = la + ls + lb;
+    if (len) {
+        size_t n = 0;
+        const char *parts[3] = { a, s, b };
+        size_t lens[3] = { la, ls, lb };
+        for (int i = 0; i < 3 && n < len - 1; i++) {
+            size_t m = lens[i] < len - 1 - n ? lens[i] : len - 1 - n;
+            memcpy (buf + n, parts[i], m);
+            n += m;
+        }
+        buf[n] = '\0';
+    }
+    return total;
+}
+
+void f_strbuf_append_color (f_strbuf *b, const char *s, int color) {
+    const char *code = _colors_on () ? _color_code (color) : NULL;
+    if (code)
+        f_strbuf_append (b, code);
+    f_strbuf_append (b, s);
+    if (code)
+        f_strbuf_append (b, COL[0]);
+}
+
+/* Fills iov with (escape, s, reset), or just s if colors are off, for
+ * writev. Returns the number of entries used; iov needs room for 3.
+ */
+int f_color_iov (struct iovec *iov, const char *s, int color) {
+    const char *code = _colors_on () ? _color_code (color) : NULL;
+    if (!code) {
+        iov[0].iov_base = (char *) s;
+        iov[0].iov_len = strlen (s);
+        return 1;
+    }
+    iov[0].iov_base = (char *) code;
+    iov[0].iov_len = strlen (code);
+    iov[1].iov_base = (char *) s;
+    iov[1].iov_len = strlen (s);
+    iov[2].iov_base = COL[0];
+    iov[2].iov_len = strlen (COL[0]);
+    return 3;
+}
+
+/* String with all nulls (can't use strlen).
+ * length includes \0.
+ * Caller should free.
+ */
+__attribute__ ((noinline)) char *str (int length) {
+    assert (length > 0);
+    char *s = _f_malloc (length * sizeof (char), __builtin_return_address (0));
+    memset (s, '\0', length);
+    return s;
+}
+
+/* Is null-terminated, even if size too small.
+ * Goes through the scratch slot, because the arguments can be static
+ * strings themselves.
+ */
+void spr (const char *format, ...) {
+    _static_str_ensure ();
+    int size = _static_str_len; // with \0
+    char *s = _static_str_mem + _static_str_num * size;
+    va_list arglist;
+    va_start ( arglist, format );
+    int l = vsnprintf (s, size, format, arglist);
+    va_end ( arglist );
+
+    if (l < 0) {
+        *s = '\0';
+        l = 0;
+    }
+    else if (l > size - 1) {
+        warn ("static string truncated (%s)", s);
+        l = size - 1;
+    }
+    memcpy (_get_static_str_ptr (), s, l + 1);
+}
+
+/* Caller should free.
+ */
+char *spr_ (const char *format, int size /*with null*/, ...) {
+    char *s = str (size);
+    va_list arglist;
+    va_start ( arglist, size );
+    vsnprintf (s, size, format, arglist);
+    va_end ( arglist );
+    return s;
+}
+
+/* Only the first byte of each slot is cleared.
+ */
+void _ () {
+    _static_str_ensure ();
+
+    _static_str_idx = -1;
+    for (int i = 0; i < _static_str_num; i++)
+        _static_str_mem[i * _static_str_len] = '\0';
+}
+
+/* Takes effect for threads which haven't used the static strings yet, and
+ * for the calling thread, whose strings are reset.
+ * num can't be less than the eight named ones.
+ */
+void f_static_str_config (int num, int length) {
+    if (num < NUM_STATIC_STRINGS) {
+        warn ("f_static_str_config: need at least %d static strings (got %d)", NUM_STATIC_STRINGS, num);
+        num = NUM_STATIC_STRINGS;
+    }
+    if (length < 2) {
+        warn ("f_static_str_config: length too small (%d)", length);
+        return;
+    }
+    _static_str_num_conf = num;
+    _static_str_len_conf = length;
+    if (_static_str_initted) {
+        _static_strings_free ();
+        _static_str_init ();
+    }
+}
+
+/* Slot i of the calling thread's ring (0 is _s).
+ */
+char *f_get_static_str (int i) {
+    _static_str_ensure ();
+    if (i < 0 || i >= _static_str_num) {
+        iwarn ("f_get_static_str: no static string %d", i);
+        return NULL;
+    }
+    return _static_str_mem + i * _static_str_len;
+}
+
+int f_get_static_str_num () {
+    return _static_str_initted ? _static_str_num : _static_str_num_conf;
+}
+
+char *R_ (const char *s) {
+    return _color (s, F_COLOR_RED);
+}
+char *BR_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_RED);
+}
+char *G_ (const char *s) {
+    return _color (s, F_COLOR_GREEN);
+}
+char *BG_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_GREEN);
+}
+char *Y_ (const char *s) {
+    return _color (s, F_COLOR_YELLOW);
+}
+char *BY_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_YELLOW);
+}
+char *B_ (const char *s) {
+    return _color (s, F_COLOR_BLUE);
+}
+char *BB_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_BLUE);
+}
+char *CY_ (const char *s) {
+    return _color (s, F_COLOR_CYAN);
+}
+char *BCY_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_CYAN);
+}
+char *M_ (const char *s) {
+    return _color (s, F_COLOR_MAGENTA);
+}
+char *BM_ (const char *s) {
+    return _color (s, F_COLOR_BRIGHT_MAGENTA);
+}
+
+void R (const char *s) {
+    _color_static (s, F_COLOR_RED);
+}
+
+void BR (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_RED);
+}
+
+void G (const char *s) {
+    _color_static (s, F_COLOR_GREEN);
+}
+
+void BG (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_GREEN);
+}
+
+void Y (const char *s) {
+    _color_static (s, F_COLOR_YELLOW);
+}
+
+void BY (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_YELLOW);
+}
+
+void B (const char *s) {
+    _color_static (s, F_COLOR_BLUE);
+}
+
+void BB (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_BLUE);
+}
+
+void CY (const char *s) {
+    _color_static (s, F_COLOR_CYAN);
+}
+
+void BCY (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_CYAN);
+}
+
+void M (const char *s) {
+    _color_static (s, F_COLOR_MAGENTA);
+}
+
+void BM (const char *s) {
+    _color_static (s, F_COLOR_BRIGHT_MAGENTA);
+}
+
+/* Returns either a static pointer to a string (don't free it), in which
+ * case buf is unused, or a pointer to the string stored in buf. In the
+ * second case, does it need to be freed? XX
+ */
+
+const char *perr () {
+    char *st = f_pool_str (100);
+    char *ret = strerror_r (errno, st, 100);
+    if (*st == '\0') {
+        // buffer unused
+        f_pool_free (st);
+        return ret;
+    }
+    else {
+        iwarn ("fixme: perr stored string in buf, possible leak.");
+        f_pool_free (st);
+        return ret;
+    }
+}
+
+char *add_nl (const char *orig) {
+    // not including null
+    int len = strlen (orig);
+    char *new = f_malloc (sizeof (char) * (len + 2));
+    memset (new, '\0', len + 2);
+    // no null
+    strncpy (new, orig, len);
+    // adds null
+    strcat (new, "\n");
+    return new;
+}
+
+static void _async_thread_exit (void *ring) {
+    __atomic_store_n (&((struct async_ring *) ring)->dead, true, __ATOMIC_RELEASE);
+}
+
+static void _async_key_init () {
+    pthread_key_create (&_async_key, _async_thread_exit);
+}
+
+static struct async_ring *_async_ring () {
+    if (_async_my_ring)
+        return _async_my_ring;
+    struct async_ring *r = f_calloc (1, sizeof (struct async_ring));
+    r->size = _async_ring_size;
+    r->buf = f_malloc (r->size);
+    pthread_once (&_async_once, _async_key_init);
+    pthread_setspecific (_async_key, r);
+    pthread_mutex_lock (&_async_lock);
+    r->next = _async_rings;
+    _async_rings = r;
+    pthread_mutex_unlock (&_async_lock);
+    _async_my_ring = r;
+    return r;
+}
+
+static void _async_copy_in (struct async_ring *r, size_t pos, const void *from, size_t len) {
+    size_t off = pos & (r->size - 1);
+    size_t first = len < r->size - off ? len : r->size - off;
+    memcpy (r->buf + off, from, first);
+    memcpy (r->buf, (const char *) from + first, len - first);
+}
+
+static void _async_copy_out (struct async_ring *r, size_t pos, void *to, size_t len) {
+    size_t off = pos & (r->size - 1);
+    size_t first = len < r->size - off ? len : r->size - off;
+    memcpy (to, r->buf + off, first);
+    memcpy ((char *) to + first, r->buf, len - first);
+}
+
+// with _async_lock held.
+static void _async_wake_locked () {
+    _async_wakes++;
+    pthread_cond_signal (&_async_wake_cond);
+}
+
+static void _async_wake () {
+    pthread_mutex_lock (&_async_lock);
+    _async_wake_locked ();
+    pthread_mutex_unlock (&_async_lock);
+}
+
+static bool _async_room (struct async_ring *r, size_t head, size_t need) {
+    return r->size - (head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE)) >= need;
+}
+
+/* false: too big for the ring, caller should write it itself.
+ * Lock-free, unless the writer thread is asleep and has to be woken.
+ */
+static bool _async_push (int fd, const char *buf, size_t len) {
+    struct async_ring *r = _async_ring ();
+    size_t need = sizeof (struct async_rec) + len;
+    if (need > r->size)
+        return false;
+    size_t head = r->head;
+    if (!_async_room (r, head, need)) {
+        if (_async_policy != F_ASYNC_BLOCK) {
+            __atomic_add_fetch (&r->dropped, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        /* The drain moves tail before taking the lock to signal room, so
+         * checking under the lock can't miss it. f_async_stop drains the
+         * rings until we're done, so we can wait.
+         */
+        pthread_mutex_lock (&_async_lock);
+        _async_blocked++;
+        while (!_async_room (r, head, need)) {
+            _async_wake_locked ();
+            pthread_cond_wait (&_async_room_cond, &_async_lock);
+        }
+        _async_blocked--;
+        pthread_mutex_unlock (&_async_lock);
+    }
+    struct async_rec rec = { len, fd };
+    _async_copy_in (r, head, &rec, sizeof (rec));
+    _async_copy_in (r, head + sizeof (rec), buf, len);
+    /* seq_cst on both sides (see _async_main): either we see it asleep,
+     * or it sees our record when it looks again.
+     */
+    __atomic_store_n (&r->head, head + need, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&_async_sleeping, __ATOMIC_SEQ_CST))
+        _async_wake ();
+    return true;
+}
+
+/* Producers hold this around pushing, so that f_async_stop can wait for
+ * them before its last drain. false: async is off, write directly.
+ */
+static bool _async_enter () {
+    __atomic_add_fetch (&_async_users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&_async_on, __ATOMIC_SEQ_CST))
+        return true;
+    __atomic_sub_fetch (&_async_users, 1, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+static void _async_leave () {
+    __atomic_sub_fetch (&_async_users, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Retries short writes and EINTR. Gives up quietly on other errors: there's
+ * nowhere left to complain to.
+ */
+static void _writev_all (int fd, struct iovec *iov, int n) {
+    while (n) {
+        ssize_t rc = writev (fd, iov, n);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        while (n && (size_t) rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+/* Returns whether there was anything.
+ * Consecutive records for the same fd go out in one writev.
+ */
+static bool _async_drain (struct async_ring *r) {
+    size_t tail = r->tail;
+    size_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+    bool any = tail != head;
+    struct iovec iov[ASYNC_IOV];
+    int n = 0;
+    int fd = -1;
+    while (tail != head) {
+        struct async_rec rec;
+        _async_copy_out (r, tail, &rec, sizeof (rec));
+        if (n && (rec.fd != fd || n + 2 > ASYNC_IOV)) {
+            _writev_all (fd, iov, n);
+            __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+            n = 0;
+        }
+        fd = rec.fd;
+        size_t off = (tail + sizeof (rec)) & (r->size - 1);
+        size_t first = rec.len < r->size - off ? rec.len : r->size - off;
+        iov[n].iov_base = r->buf + off;
+        iov[n++].iov_len = first;
+        if (first < rec.len) {
+            iov[n].iov_base = r->buf;
+            iov[n++].iov_len = rec.len - first;
+        }
+        tail += sizeof (rec) + rec.len;
+    }
+    if (n)
+        _writev_all (fd, iov, n);
+    __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+
+    long dropped = __atomic_exchange_n (&r->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        __atomic_add_fetch (&_async_dropped_total, dropped, __ATOMIC_RELAXED);
+        if (_async_policy == F_ASYNC_DROP_REPORT) {
+            char msg[100];
+            int l = snprintf (msg, sizeof (msg), "(%ld log messages dropped)\n", dropped);
+            struct iovec v = { msg, l };
+            _writev_all (STDERR_FILENO, &v, 1);
+        }
+    }
+    return any;
+}
+
+/* One pass over all rings; frees the rings of exited threads once they're
+ * empty, and wakes producers waiting for room.
+ */
+static bool _async_drain_all () {
+    bool any = false;
+    pthread_mutex_lock (&_async_lock);
+    struct async_ring *r = _async_rings;
+    pthread_mutex_unlock (&_async_lock);
+    for (; r; r = r->next)
+        if (_async_drain (r))
+            any = true;
+
+    pthread_mutex_lock (&_async_lock);
+    struct async_ring **p = &_async_rings;
+    while (*p) {
+        r = *p;
+        if (__atomic_load_n (&r->dead, __ATOMIC_ACQUIRE) && r->tail == __atomic_load_n (&r->head, __ATOMIC_ACQUIRE)) {
+            *p = r->next;
+            f_free (r->buf);
+            f_free (r);
+        }
+        else
+            p = &r->next;
+    }
+    if (any && _async_blocked)
+        pthread_cond_broadcast (&_async_room_cond);
+    pthread_mutex_unlock (&_async_lock);
+    return any;
+}
+
+static void *_async_main (void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock (&_async_lock);
+        long req = _async_flush_req;
+        bool stopping = _async_stopping;
+        pthread_mutex_unlock (&_async_lock);
+
+        bool any = _async_drain_all ();
+
+        pthread_mutex_lock (&_async_lock);
+        _async_flush_done = req;
+        pthread_cond_broadcast (&_async_flushed_cond);
+        if (stopping) {
+            pthread_mutex_unlock (&_async_lock);
+            break;
+        }
+        if (!any && _async_flush_req == req) {
+            /* Producers check _async_sleeping after writing. One which
+             * wrote after our pass but before it could see the flag didn't
+             * wake us, so look once more; one which did see it bumps
+             * _async_wakes (and can't have done so before we read it: the
+             * flag went up under the lock).
+             */
+            __atomic_store_n (&_async_sleeping, true, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence (__ATOMIC_SEQ_CST);
+            long wakes = _async_wakes;
+            pthread_mutex_unlock (&_async_lock);
+            bool late = _async_drain_all ();
+            pthread_mutex_lock (&_async_lock);
+            if (!late && _async_wakes == wakes && _async_flush_req == req && !_async_stopping) {
+                struct timespec ts;
+                clock_gettime (CLOCK_REALTIME, &ts);
+                ts.tv_nsec += ASYNC_WAIT * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait (&_async_wake_cond, &_async_lock, &ts);
+            }
+            __atomic_store_n (&_async_sleeping, false, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock (&_async_lock);
+    }
+    return NULL;
+}
+
+static void _async_atexit () {
+    f_async_stop ();
+}
+
+/* From now on, say, info, warn etc. only copy their message into a
+ * per-thread ring, and a background thread writes them out.
+ * They go to fds 1 and 2 directly, so don't mix with printf on the same
+ * streams unless you flush.
+ * ring_size: bytes per thread, rounded up to a power of 2 (0: 256k).
+ * flags: what to do when a ring is full. F_ASYNC_BLOCK (default) waits,
+ * F_ASYNC_DROP drops the message, F_ASYNC_DROP_REPORT drops and writes a
+ * line saying how many were dropped.
+ * Messages are flushed by err (), at exit, and by f_async_flush.
+ */
+bool f_async_start (size_t ring_size, int flags) {
+    if (__atomic_load_n (&_async_on, __ATOMIC_SEQ_CST))
+        return true;
+    size_t size = 1024;
+    while (size < (ring_size ? ring_size : ASYNC_RING_DEFAULT))
+        size <<= 1;
+    _async_ring_size = size;
+    _async_policy =
+        flags & F_ASYNC_DROP ? F_ASYNC_DROP :
+        flags & F_ASYNC_DROP_REPORT ? F_ASYNC_DROP_REPORT :
+        F_ASYNC_BLOCK;
+    _async_stopping = false;
+
+    fflush (stdout);
+    fflush (stderr);
+
+    int rc = pthread_create (&_async_thread, NULL, _async_main, NULL);
+    if (rc) {
+        errno = rc;
+        warn_perr ("Couldn't start logging thread");
+        return false;
+    }
+    if (!_async_atexit_set) {
+        atexit (_async_atexit);
+        _async_atexit_set = true;
+    }
+    __atomic_store_n (&_async_on, true, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+/* Returns when everything logged before the call has been written.
+ */
+void f_async_flush () {
+    if (!__atomic_load_n (&_async_on, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock (&_async_lock);
+    long req = ++_async_flush_req;
+    pthread_cond_signal (&_async_wake_cond);
+    while (_async_flush_done < req && !_async_stopping)
+        pthread_cond_wait (&_async_flushed_cond, &_async_lock);
+    pthread_mutex_unlock (&_async_lock);
+}
+
+/* Writes whatever's left and stops the thread; back to writing directly.
+ */
+void f_async_stop () {
+    if (!__atomic_exchange_n (&_async_on, false, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock (&_async_lock);
+    _async_stopping = true;
+    pthread_cond_signal (&_async_wake_cond);
+    pthread_mutex_unlock (&_async_lock);
+    pthread_join (_async_thread, NULL);
+    /* Producers which saw _async_on before it went off: wait for them,
+     * draining in case they're waiting for room.
+     */
+    while (__atomic_load_n (&_async_users, __ATOMIC_SEQ_CST)) {
+        _async_drain_all ();
+        struct timespec ts = { 0, 100000 };
+        nanosleep (&ts, NULL);
+    }
+    _async_drain_all ();
+}
+
+long f_async_dropped () {
+    return __atomic_load_n (&_async_dropped_total, __ATOMIC_RELAXED);
+}
+
+static int _log_level_from_name (const char *name, int len) {
+    const char *names[] = { "debug", "info", "warn", "err" };
+    for (int i = 0; i < 4; i++)
+        if (strlen (names[i]) == (size_t) len && !strncmp (names[i], name, len))
+            return F_LOG_DEBUG + i;
+    if (len == 5 && !strncmp (name, "error", 5))
+        return F_LOG_ERR;
+    return 0;
+}
+
+static void _log_threshold_update () {
+    int t = _log_level;
+    for (int i = 0; i < _log_num_modules; i++)
+        if (_log_modules[i].level < t)
+            t = _log_modules[i].level;
+    __atomic_store_n (&_f_log_threshold, t, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&_log_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* FISH_LOG=<level>,<module>=<level>,...
+ */
+static void _log_init () {
+    _log_initting = true;
+    const char *env = getenv ("FISH_LOG");
+    while (env && *env) {
+        const char *end = strchrnul (env, ',');
+        const char *eq = memchr (env, '=', end - env);
+        if (eq) {
+            int level = _log_level_from_name (eq + 1, end - eq - 1);
+            char module[LOG_MODULE_LENGTH];
+            snprintf (module, sizeof (module), "%.*s", (int) (eq - env), env);
+            if (!level || !f_log_module_level (module, level))
+                warn ("FISH_LOG: ignoring %.*s", (int) (end - env), env);
+        }
+        else {
+            int level = _log_level_from_name (env, end - env);
+            if (level)
+                _log_level = level;
+            else
+                warn ("FISH_LOG: unknown level %.*s", (int) (end - env), env);
+        }
+        env = *end ? end + 1 : end;
+    }
+    _log_threshold_update ();
+    _log_initting = false;
+}
+
+static void _log_ensure () {
+    if (!_log_initting)
+        pthread_once (&_log_once, _log_init);
+}
+
+/* Module name matches the basename of file, with or without extension.
+ */
+static bool _log_module_match (const char *module, const char *file) {
+    const char *base = strrchr (file, '/');
+    base = base ? base + 1 : file;
+    int len = strlen (module);
+    return !strncmp (base, module, len) && (base[len] == '\0' || base[len] == '.');
+}
+
+static int _log_file_level (const char *file) {
+    if (file && *file) {
+        for (int i = 0; i < _log_num_modules; i++)
+            if (_log_module_match (_log_modules[i].name, file))
+                return _log_modules[i].level;
+    }
+    return _log_level;
+}
+
+/* The slow half of f_log_enabled: only reached when the level is at least
+ * the lowest anyone wants.
+ */
+bool _f_log_on (const char *file, int level) {
+    _log_ensure ();
+    return level >= _log_file_level (file);
+}
+
+/* Same, with the file's level cached in the call site until the next
+ * change. One atomic word, so threads racing to fill it in are harmless.
+ */
+bool _f_log_cache_on (struct f_log_cache *cache, int level) {
+    _log_ensure ();
+    long gen = __atomic_load_n (&_log_gen, __ATOMIC_ACQUIRE);
+    long state = __atomic_load_n (&cache->state, __ATOMIC_RELAXED);
+    int file_level;
+    if (state >> 8 == gen)
+        file_level = state & 0xff;
+    else {
+        file_level = _log_file_level (cache->file);
+        __atomic_store_n (&cache->state, gen << 8 | file_level, __ATOMIC_RELAXED);
+    }
+    return level >= file_level;
+}
+
+void f_log_level (int level) {
+    _log_ensure ();
+    _log_level = level;
+    _log_threshold_update ();
+}
+
+int f_log_get_level () {
+    _log_ensure ();
+    return _log_level;
+}
+
+bool f_log_module_level (const char *module, int level) {
+    _log_ensure ();
+    int i;
+    for (i = 0; i < _log_num_modules; i++)
+        if (!strcmp (_log_modules[i].name, module))
+            break;
+    if (i == LOG_MAX_MODULES) {
+        iwarn ("Too many log modules (max %d)", LOG_MAX_MODULES);
+        return false;
+    }
+    if (strlen (module) >= LOG_MODULE_LENGTH) {
+        iwarn ("Log module name too long: %s", module);
+        return false;
+    }
+    strcpy (_log_modules[i].name, module);
+    _log_modules[i].level = level;
+    if (i == _log_num_modules)
+        _log_num_modules++;
+    _log_threshold_update ();
+    return true;
+}
+
+void f_log_format (int format) {
+    _log_format = format;
+}
+
+/* burst = 0 turns it off.
+ */
+void f_warn_rate_limit (int burst, int interval_ms) {
+    _rate_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    _f_rate_burst = burst > 0 ? burst : 0;
+}
+
+static long _coarse_ms () {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _site_report (struct f_site *site, unsigned long n) {
+    _complain_site (site, false, false,
+        "(suppressed %lu similar message%s)", n, n == 1 ? "" : "s");
+}
+
+/* Reports the sites that went quiet with messages still suppressed: a
+ * whole interval without a refill. Runs at most once an interval, from
+ * whichever warning gets there first, so a site that stops firing doesn't
+ * have to wait for cleanup.
+ */
+static void _sites_sweep (long now) {
+    int interval = _rate_interval_ms;
+    long swept = __atomic_load_n (&_sites_swept, __ATOMIC_RELAXED);
+    if (now - swept < interval || !__atomic_compare_exchange_n (&_sites_swept, &swept, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    for (struct f_site *site = __atomic_load_n (&_sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+        if (!__atomic_load_n (&site->suppressed, __ATOMIC_RELAXED))
+            continue;
+        if (now - __atomic_load_n (&site->last, __ATOMIC_RELAXED) < interval)
+            continue;
+        unsigned long n = __atomic_exchange_n (&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (n)
+            _site_report (site, n);
+    }
+}
+
+/* Out of tokens: add the ones earned since the last refill, or count the
+ * message as suppressed.
+ */
+bool _f_site_refill (struct f_site *site) {
+    int burst = _f_rate_burst;
+    long now = _coarse_ms ();
+    _sites_sweep (now);
+    long last = __atomic_load_n (&site->last, __ATOMIC_RELAXED);
+    while (true) {
+        long earned = last ? (now - last) * burst / _rate_interval_ms : burst;
+        if (earned < 1)
+            break;
+
+        // the CAS picks one thread to do the refill.
+        // keep the remainder: move last forward only by what was earned.
+        long next = last && earned < burst ? last + earned * _rate_interval_ms / burst : now;
+        if (__atomic_compare_exchange_n (&site->last, &last, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            int tokens = __atomic_load_n (&site->tokens, __ATOMIC_RELAXED);
+            if (tokens < 0)
+                tokens = 0;
+            tokens = tokens + earned > burst ? burst : tokens + earned;
+            __atomic_store_n (&site->tokens, tokens - 1, __ATOMIC_RELAXED);
+            unsigned long n = __atomic_exchange_n (&site->suppressed, 0, __ATOMIC_RELAXED);
+            if (n)
+                _site_report (site, n);
+            return true;
+        }
+        /* Someone else refilled: take one of theirs, else go round with
+         * the last the CAS gave us, in case there's still some to earn.
+         */
+        if (__atomic_load_n (&site->tokens, __ATOMIC_RELAXED) > 0 &&
+            __atomic_sub_fetch (&site->tokens, 1, __ATOMIC_RELAXED) >= 0)
+            return true;
+    }
+
+    __atomic_add_fetch (&site->suppressed, 1, __ATOMIC_RELAXED);
+    int zero = 0;
+    if (__atomic_compare_exchange_n (&site->listed, &zero, 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        site->next = __atomic_load_n (&_sites, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&_sites, &site->next, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    return false;
+}
+
+static void _sites_report () {
+    for (struct f_site *site = __atomic_load_n (&_sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+        unsigned long n = __atomic_exchange_n (&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (n)
+            _site_report (site, n);
+    }
+}
+
+static void _json_append_str (f_strbuf *b, const char *s, size_t len) {
+    if (!s) {
+        f_strbuf_append (b, "null");
+        return;
+    }
+    f_strbuf_reserve (b, len + 2);
+    f_strbuf_append_c (b, '"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            f_strbuf_append_c (b, '\\');
+            f_strbuf_append_c (b, c);
+        }
+        else if (c == '\n')
+            f_strbuf_append (b, "\\n");
+        else if (c == '\t')
+            f_strbuf_append (b, "\\t");
+        else if (c < 0x20)
+            f_strbuf_appendf (b, "\\u%04x", c);
+        else
+            f_strbuf_append_c (b, c);
+    }
+    f_strbuf_append_c (b, '"');
+}
+
+/* Structured version of _complain, info and _debug: one record, one write.
+ */
+static void _log_record (int class, int level, const char *file, unsigned int line, const char *errtext, const char *format, va_list arglist) {
+    const char *names[] = { "debug", "info", "warn", "error" };
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+
+    f_strbuf msg;
+    f_strbuf_init (&msg);
+    f_strbuf_vappendf (&msg, format, arglist);
+
+    size_t file_len = file ? strlen (file) : 0;
+    size_t errno_len = errtext ? strlen (errtext) : 0;
+
+    f_strbuf b;
+    f_strbuf_init (&b);
+    if (_log_format == F_LOG_FORMAT_BINARY) {
+        struct f_log_record r = {
+            .len = sizeof (r) + file_len + errno_len + msg.len,
+            .line = line,
+            .ts_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec,
+            .msg_len = msg.len,
+            .file_len = file_len,
+            .errno_len = errno_len,
+            .level = level,
+        };
+        f_strbuf_reserve (&b, r.len);
+        f_strbuf_append_n (&b, (const char *) &r, sizeof (r));
+        f_strbuf_append_n (&b, file, file_len);
+        f_strbuf_append_n (&b, errtext, errno_len);
+        f_strbuf_append_n (&b, msg.buf, msg.len);
+    }
+    else {
+        f_strbuf_appendf (&b, "{\"ts\":%ld.%06ld,\"level\":\"%s\",\"file\":",
+            (long) ts.tv_sec, ts.tv_nsec / 1000, names[level - F_LOG_DEBUG]);
+        _json_append_str (&b, file, file_len);
+        f_strbuf_appendf (&b, ",\"line\":%u,\"errno\":", line);
+        _json_append_str (&b, errtext, errno_len);
+        f_strbuf_append (&b, ",\"msg\":");
+        _json_append_str (&b, msg.buf, msg.len);
+        f_strbuf_append (&b, "}\n");
+    }
+
+    if (__atomic_load_n (&_async_on, __ATOMIC_RELAXED) || __atomic_load_n (&_out_sinks[class], __ATOMIC_RELAXED))
+        _emit (class, b.buf, b.len);
+    else {
+        // as in _emit (class is info, warn or debug).
+        if (_flight_on)
+            _flight_record (b.buf, b.len);
+        int fd = class == F_OUT_WARN ? STDERR_FILENO : STDOUT_FILENO;
+        // don't let stdio split it or put it out of order.
+        fflush (fd == STDERR_FILENO ? stderr : stdout);
+        struct iovec v = { b.buf, b.len };
+        _writev_all (fd, &v, 1);
+    }
+    f_strbuf_free (&msg);
+    f_strbuf_free (&b);
+}
+
+static long _mono_ms () {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Caller holds tb->lock.
+ */
+static void _sink_tbuf_flush (struct sink_tbuf *tb) {
+    if (tb->len && tb->sink->id == tb->id) {
+        struct iovec v = { tb->buf, tb->len };
+        _writev_all (tb->sink->fd, &v, 1);
+    }
+    tb->len = 0;
+    tb->last = _mono_ms ();
+}
+
+/* Thread exit: flush and forget this thread's buffers.
+ */
+static void _sink_thread_exit (void *p) {
+    struct sink_tbuf *tb = p;
+    pthread_mutex_lock (&_sink_lock);
+    while (tb) {
+        struct sink_tbuf *next = tb->next;
+        pthread_mutex_lock (&tb->lock);
+        _sink_tbuf_flush (tb);
+        pthread_mutex_unlock (&tb->lock);
+        if (tb->all_prev)
+            tb->all_prev->all_next = tb->all_next;
+        else
+            _sink_tbufs = tb->all_next;
+        if (tb->all_next)
+            tb->all_next->all_prev = tb->all_prev;
+        pthread_mutex_destroy (&tb->lock);
+        f_free (tb->buf);
+        f_free (tb);
+        tb = next;
+    }
+    pthread_mutex_unlock (&_sink_lock);
+    _sink_my_tbufs = NULL;
+}
+
+static void _sink_atexit () {
+    f_out_flush ();
+}
+
+static void _sink_key_init () {
+    pthread_key_create (&_sink_key, _sink_thread_exit);
+    atexit (_sink_atexit);
+}
+
+static struct sink_tbuf *_sink_tbuf_get (struct f_sink *sink) {
+    struct sink_tbuf *tb;
+    for (tb = _sink_my_tbufs; tb; tb = tb->next)
+        if (tb->sink == sink && tb->id == sink->id)
+            return tb;
+    // a stale one for a destroyed sink in the same slot is reused.
+    for (tb = _sink_my_tbufs; tb; tb = tb->next)
+        if (tb->sink == sink)
+            break;
+    if (tb) {
+        pthread_mutex_lock (&tb->lock);
+        tb->len = 0;
+        if (tb->id != sink->id) {
+            f_free (tb->buf);
+            tb->buf = f_malloc (sink->bufsize);
+        }
+        tb->id = sink->id;
+        pthread_mutex_unlock (&tb->lock);
+        return tb;
+    }
+    pthread_once (&_sink_once, _sink_key_init);
+    tb = f_mallocv (*tb);
+    memset (tb, 0, sizeof (*tb));
+    tb->sink = sink;
+    tb->id = sink->id;
+    pthread_mutex_init (&tb->lock, NULL);
+    tb->buf = f_malloc (sink->bufsize);
+    tb->last = _mono_ms ();
+    tb->next = _sink_my_tbufs;
+    _sink_my_tbufs = tb;
+    pthread_setspecific (_sink_key, tb);
+    pthread_mutex_lock (&_sink_lock);
+    tb->all_next = _sink_tbufs;
+    if (_sink_tbufs)
+        _sink_tbufs->all_prev = tb;
+    _sink_tbufs = tb;
+    pthread_mutex_unlock (&_sink_lock);
+    return tb;
+}
+
+static void _sink_write_fd (struct f_sink *sink, const char *buf, size_t len) {
+    struct sink_tbuf *tb = _sink_tbuf_get (sink);
+    pthread_mutex_lock (&tb->lock);
+    if (tb->len + len > sink->bufsize)
+        _sink_tbuf_flush (tb);
+    if (len >= sink->bufsize) {
+        struct iovec v = { (char *) buf, len };
+        _writev_all (sink->fd, &v, 1);
+    }
+    else {
+        memcpy (tb->buf + tb->len, buf, len);
+        tb->len += len;
+        if (sink->flush_ms && _mono_ms () - tb->last >= sink->flush_ms)
+            _sink_tbuf_flush (tb);
+    }
+    pthread_mutex_unlock (&tb->lock);
+}
+
+static void _sink_write_memory (struct f_sink *sink, const char *buf, size_t len) {
+    pthread_mutex_lock (&sink->lock);
+    // only the last size bytes survive anyway.
+    if (len > sink->size) {
+        sink->total += len - sink->size;
+        buf += len - sink->size;
+        len = sink->size;
+    }
+    size_t pos = sink->total % sink->size;
+    size_t n = len < sink->size - pos ? len : sink->size - pos;
+    memcpy (sink->ring + pos, buf, n);
+    memcpy (sink->ring, buf + n, len - n);
+    sink->total += len;
+    pthread_mutex_unlock (&sink->lock);
+}
+
+/* Flushes buffers which have been sitting longer than their sink's
+ * flush_ms.
+ */
+static void *_sink_flusher (void *arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock (&_sink_lock);
+        int tick = _sink_tick_ms;
+        pthread_mutex_unlock (&_sink_lock);
+        struct timespec ts = { tick / 1000, (tick % 1000) * 1000000 };
+        nanosleep (&ts, NULL);
+        long now = _mono_ms ();
+        pthread_mutex_lock (&_sink_lock);
+        for (struct sink_tbuf *tb = _sink_tbufs; tb; tb = tb->all_next) {
+            pthread_mutex_lock (&tb->lock);
+            int flush_ms = tb->sink->flush_ms;
+            if (tb->len && flush_ms && now - tb->last >= flush_ms)
+                _sink_tbuf_flush (tb);
+            pthread_mutex_unlock (&tb->lock);
+        }
+        pthread_mutex_unlock (&_sink_lock);
+    }
+    return NULL;
+}
+
+/* Writers hold this while they use the sink, so that f_sink_destroy can
+ * wait for them. false: class isn't routed to sink any more (it's being
+ * destroyed); looking at _out_sinks again rather than at the sink means
+ * a slot which has been reused meanwhile is never touched.
+ */
+static bool _sink_enter (int class, struct f_sink *sink) {
+    long *users = &_sink_users[sink - _sinks];
+    __atomic_add_fetch (users, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&_out_sinks[class], __ATOMIC_SEQ_CST) == sink)
+        return true;
+    __atomic_sub_fetch (users, 1, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+static void _sink_leave (struct f_sink *sink) {
+    __atomic_sub_fetch (&_sink_users[sink - _sinks], 1, __ATOMIC_SEQ_CST);
+}
+
+static struct f_sink *_sink_new (int type) {
+    struct f_sink *sink = NULL;
+    pthread_mutex_lock (&_sink_lock);
+    for (int i = 0; i < SINK_MAX; i++)
+        if (!_sinks[i].type) {
+            sink = &_sinks[i];
+            break;
+        }
+    if (sink) {
+        memset (sink, 0, sizeof (*sink));
+        sink->type = type;
+        // ids only grow, so never match an old buffer.
+        sink->id = ++_sink_id;
+    }
+    pthread_mutex_unlock (&_sink_lock);
+    if (!sink)
+        iwarn ("Too many sinks (max %d)", SINK_MAX);
+    return sink;
+}
+
+f_sink *f_sink_fd (int fd, size_t bufsize, int flush_ms) {
+    struct f_sink *sink = _sink_new (SINK_FD);
+    if (!sink)
+        return NULL;
+    sink->fd = fd;
+    sink->bufsize = bufsize ? bufsize : SINK_BUF_DEFAULT;
+    sink->flush_ms = flush_ms > 0 ? flush_ms : 0;
+    if (sink->flush_ms) {
+        pthread_mutex_lock (&_sink_lock);
+        if (!_sink_tick_ms || sink->flush_ms < _sink_tick_ms)
+            _sink_tick_ms = sink->flush_ms;
+        bool start = !_sink_flusher_started;
+        _sink_flusher_started = true;
+        pthread_mutex_unlock (&_sink_lock);
+        if (start) {
+            pthread_t t;
+            pthread_attr_t attr;
+            pthread_attr_init (&attr);
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create (&t, &attr, _sink_flusher, NULL))
+                iwarn ("Couldn't start sink flusher thread");
+            pthread_attr_destroy (&attr);
+        }
+    }
+    return sink;
+}
+
+f_sink *f_sink_file (const char *path, size_t bufsize, int flush_ms) {
+    int fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        iwarn ("Couldn't open %s: %s", path, perr ());
+        return NULL;
+    }
+    struct f_sink *sink = f_sink_fd (fd, bufsize, flush_ms);
+    if (!sink) {
+        close (fd);
+        return NULL;
+    }
+    sink->own_fd = true;
+    return sink;
+}
+
+f_sink *f_sink_memory (size_t size) {
+    if (!size) {
+        iwarn ("Memory sink needs a size");
+        return NULL;
+    }
+    struct f_sink *sink = _sink_new (SINK_MEMORY);
+    if (!sink)
+        return NULL;
+    pthread_mutex_init (&sink->lock, NULL);
+    sink->ring = f_malloc (size);
+    sink->size = size;
+    return sink;
+}
+
+f_sink *f_sink_callback (f_sink_func func, void *data) {
+    struct f_sink *sink = _sink_new (SINK_CALLBACK);
+    if (!sink)
+        return NULL;
+    sink->func = func;
+    sink->data = data;
+    return sink;
+}
+
+/* Returns number of bytes copied (not terminated).
+ */
+size_t f_sink_memory_read (f_sink *sink, char *buf, size_t len) {
+    if (sink->type != SINK_MEMORY) {
+        piep;
+        return 0;
+    }
+    pthread_mutex_lock (&sink->lock);
+    size_t have = sink->total < sink->size ? sink->total : sink->size;
+    size_t n = len < have ? len : have;
+    // the most recent n bytes.
+    size_t start = (sink->total - n) % sink->size;
+    size_t first = n < sink->size - start ? n : sink->size - start;
+    memcpy (buf, sink->ring + start, first);
+    memcpy (buf + first, sink->ring, n - first);
+    pthread_mutex_unlock (&sink->lock);
+    return n;
+}
+
+void f_sink_memory_clear (f_sink *sink) {
+    if (sink->type != SINK_MEMORY) {
+        piep;
+        return;
+    }
+    pthread_mutex_lock (&sink->lock);
+    sink->total = 0;
+    pthread_mutex_unlock (&sink->lock);
+}
+
+void f_sink_destroy (f_sink *sink) {
+    if (!sink)
+        return;
+    for (int i = 0; i < F_OUT_NUM_CLASSES; i++) {
+        struct f_sink *s = sink;
+        __atomic_compare_exchange_n (&_out_sinks[i], &s, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+    // writers which got in before that.
+    while (__atomic_load_n (&_sink_users[sink - _sinks], __ATOMIC_SEQ_CST)) {
+        struct timespec ts = { 0, 100000 };
+        nanosleep (&ts, NULL);
+    }
+    if (sink->type == SINK_FD)
+        f_out_flush ();
+    pthread_mutex_lock (&_sink_lock);
+    // buffers still holding this id get dropped, also by the flusher.
+    sink->id = ++_sink_id;
+    pthread_mutex_unlock (&_sink_lock);
+    if (sink->type == SINK_FD) {
+        if (sink->own_fd)
+            close (sink->fd);
+    }
+    else if (sink->type == SINK_MEMORY) {
+        pthread_mutex_destroy (&sink->lock);
+        f_free (sink->ring);
+    }
+    pthread_mutex_lock (&_sink_lock);
+    sink->type = 0;
+    pthread_mutex_unlock (&_sink_lock);
+}
+
+void f_out_sink (int class, f_sink *sink) {
+    if (class < 0 || class >= F_OUT_NUM_CLASSES) {
+        iwarn ("Bad output class %d", class);
+        return;
+    }
+    __atomic_store_n (&_out_sinks[class], sink, __ATOMIC_SEQ_CST);
+}
+
+/* Flushes the buffers of all threads.
+ */
+void f_out_flush () {
+    pthread_mutex_lock (&_sink_lock);
+    for (struct sink_tbuf *tb = _sink_tbufs; tb; tb = tb->all_next) {
+        pthread_mutex_lock (&tb->lock);
+        _sink_tbuf_flush (tb);
+        pthread_mutex_unlock (&tb->lock);
+    }
+    pthread_mutex_unlock (&_sink_lock);
+}
+
+static void _flight_thread_exit (void *p) {
+    struct flight_ring *r = p;
+    __atomic_store_n (&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void _flight_key_init () {
+    pthread_key_create (&_flight_key, _flight_thread_exit);
+}
+
+static struct flight_ring *_flight_ring () {
+    if (_flight_my_ring)
+        return _flight_my_ring;
+    pthread_once (&_flight_once, _flight_key_init);
+    struct flight_ring *r;
+    for (r = __atomic_load_n (&_flight_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int zero = 0;
+        if (r->size == _flight_size && __atomic_compare_exchange_n (&r->owned, &zero, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            r->head = 0;
+            break;
+        }
+    }
+    if (!r) {
+        r = f_mallocv (*r);
+        memset (r, 0, sizeof (*r));
+        r->buf = f_malloc (_flight_size);
+        r->size = _flight_size;
+        r->owned = 1;
+        r->num = __atomic_add_fetch (&_flight_num, 1, __ATOMIC_RELAXED);
+        r->next = __atomic_load_n (&_flight_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&_flight_rings, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific (_flight_key, r);
+    _flight_my_ring = r;
+    return r;
+}
+
+static void _flight_record (const char *buf, size_t len) {
+    struct flight_ring *r = _flight_ring ();
+    unsigned long head = r->head;
+    if (len > r->size) {
+        head += len - r->size;
+        buf += len - r->size;
+        len = r->size;
+    }
+    size_t pos = head % r->size;
+    size_t n = len < r->size - pos ? len : r->size - pos;
+    memcpy (r->buf + pos, buf, n);
+    memcpy (r->buf, buf + n, len - n);
+    __atomic_store_n (&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+static void _write_safe (int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write (fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* No stdio, no malloc: also called from signal handlers.
+ */
+void f_flight_dump (int fd) {
+    int en = errno;
+    for (struct flight_ring *r = __atomic_load_n (&_flight_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+        if (!head)
+            continue;
+        char hdr[64] = "--- flight recorder, thread ";
+        size_t hl = strlen (hdr);
+        char digits[12];
+        int nd = 0;
+        for (int num = r->num; num || !nd; num /= 10)
+            digits[nd++] = '0' + num % 10;
+        while (nd)
+            hdr[hl++] = digits[--nd];
+        memcpy (hdr + hl, " ---\n", 5);
+        hl += 5;
+        _write_safe (fd, hdr, hl);
+
+        size_t len = head < r->size ? head : r->size;
+        size_t start = (head - len) % r->size;
+        // wrapped: skip the partial first message.
+        if (head > r->size) {
+            while (len && r->buf[start] != '\n') {
+                start = (start + 1) % r->size;
+                len--;
+            }
+            if (len) {
+                start = (start + 1) % r->size;
+                len--;
+            }
+        }
+        size_t first = len < r->size - start ? len : r->size - start;
+        _write_safe (fd, r->buf + start, first);
+        _write_safe (fd, r->buf, len - first);
+    }
+    errno = en;
+}
+
+static void _flight_signal (int signum) {
+    f_flight_dump (STDERR_FILENO);
+    signal (signum, SIG_DFL);
+    raise (signum);
+}
+
+bool f_flight_recorder_start (size_t size, int flags) {
+    _flight_size = size ? size : FLIGHT_RING_DEFAULT;
+    /* Started again with another size: give our ring back for reuse (it
+     * can't be freed, f_flight_dump walks the list without a lock).
+     */
+    struct flight_ring *mine = _flight_my_ring;
+    if (mine && mine->size != _flight_size) {
+        _flight_my_ring = NULL;
+        __atomic_store_n (&mine->owned, 0, __ATOMIC_RELEASE);
+    }
+    // allocate now, not during the first message.
+    _flight_ring ();
+    _f_flight_debug = flags & F_FLIGHT_DEBUG;
+    _flight_on = true;
+    if (flags & F_FLIGHT_SIGNALS) {
+        if (!f_sig (SIGSEGV, _flight_signal) || !f_sig (SIGABRT, _flight_signal))
+            return false;
+    }
+    return true;
+}
+
+/* The rings stay around (and keep their contents).
+ */
+void f_flight_recorder_stop () {
+    _flight_on = false;
+    _f_flight_debug = false;
+}
+
+/* All library output goes through here.
+ */
+static void _emit (int class, const char *buf, size_t len) {
+    if (_flight_on && (class == F_OUT_INFO || class == F_OUT_WARN || class == F_OUT_DEBUG))
+        _flight_record (buf, len);
+    struct f_sink *sink = __atomic_load_n (&_out_sinks[class], __ATOMIC_SEQ_CST);
+    if (sink && _sink_enter (class, sink)) {
+        if (sink->type == SINK_FD)
+            _sink_write_fd (sink, buf, len);
+        else if (sink->type == SINK_MEMORY)
+            _sink_write_memory (sink, buf, len);
+        else if (sink->type == SINK_CALLBACK)
+            sink->func (class, buf, len, sink->data);
+        _sink_leave (sink);
+        return;
+    }
+    int fd = class == F_OUT_WARN ? STDERR_FILENO : STDOUT_FILENO;
+    if (_async_enter ()) {
+        bool pushed = _async_push (fd, buf, len);
+        _async_leave ();
+        if (pushed)
+            return;
+        // too big for the ring: keep the order.
+        f_async_flush ();
+        struct iovec v = { (char *) buf, len };
+        _writev_all (fd, &v, 1);
+        return;
+    }
+    fwrite (buf, 1, len, fd == STDERR_FILENO ? stderr : stdout);
+}
+
+void say (const char *format, ...) {
+    f_strbuf b;
+    f_strbuf_init (&b);
+    va_list arglist;
+    va_start ( arglist, format );
+    f_strbuf_vappendf (&b, format, arglist);
+    va_end ( arglist );
+    f_strbuf_append_c (&b, '\n');
+    _emit (F_OUT_SAY, b.buf, b.len);
+    f_strbuf_free (&b);
+}
+
+void ask (const char *format, ...) {
+    f_strbuf b;
+    f_strbuf_init (&b);
+    f_strbuf_append_color (&b, get_bullet (), F_COLOR_MAGENTA);
+    f_strbuf_append_c (&b, ' ');
+    va_list arglist;
+    va_start ( arglist, format );
+    f_strbuf_vappendf (&b, format, arglist);
+    va_end ( arglist );
+    f_strbuf_append (&b, "? ");
+    if (__atomic_load_n (&_out_sinks[F_OUT_ASK], __ATOMIC_RELAXED)) {
+        _emit (F_OUT_ASK, b.buf, b.len);
+        f_out_flush ();
+    }
+    else {
+        // interactive: not through the ring.
+        f_async_flush ();
+        fwrite (b.buf, 1, b.len, stdout);
+        fflush (stdout);
+    }
+    f_strbuf_free (&b);
+}
+
+void info (const char *format, ...) {
+    if (F_LOG_INFO < _f_log_threshold || !_f_log_on (NULL, F_LOG_INFO))
+        return;
+    if (_log_format != F_LOG_FORMAT_TEXT) {
+        va_list arglist;
+        va_start (arglist, format);
+        _log_record (F_OUT_INFO, F_LOG_INFO, NULL, 0, NULL, format, arglist);
+        va_end (arglist);
+        return;
+    }
+    f_strbuf b;
+    f_strbuf_init (&b);
+    if (_log_ts)
+        _log_timestamp (&b);
+    f_strbuf_append_color (&b, get_bullet (), F_COLOR_BRIGHT_BLUE);
+    f_strbuf_append_c (&b, ' ');
+    va_list arglist;
+    va_start ( arglist, format );
+    f_strbuf_vappendf (&b, format, arglist);
+    va_end ( arglist );
+    f_strbuf_append_c (&b, '\n');
+    _emit (F_OUT_INFO, b.buf, b.len);
+    f_strbuf_free (&b);
+}
+
+/* Called by the debug macro, once the level has been checked -- or to
+ * feed the flight recorder, in which case it might not be shown.
+ */
+void _debug (struct f_site *site, const char *format, ...) {
+    // not _f_log_enabled_at: F_LOG_MIN_LEVEL is the caller's, not ours.
+    bool show = F_LOG_DEBUG >= _f_log_threshold && _f_log_cache_on (&site->log, F_LOG_DEBUG);
+    if (!show && !_flight_on)
+        return;
+    if (show && _log_format != F_LOG_FORMAT_TEXT) {
+        va_list arglist;
+        va_start (arglist, format);
+        _log_record (F_OUT_DEBUG, F_LOG_DEBUG, site->file, site->line, NULL, format, arglist);
+        va_end (arglist);
+        return;
+    }
+    f_strbuf b;
+    f_strbuf_init (&b);
+    if (_log_ts)
+        _log_timestamp (&b);
+    f_strbuf_append_color (&b, get_bullet (), F_COLOR_BRIGHT_BLUE);
+    f_strbuf_append_c (&b, ' ');
+    f_strbuf_append (&b, _site_prefix (site));
+    f_strbuf_append (&b, ":debug:");
+    va_list arglist;
+    va_start ( arglist, format );
+    f_strbuf_vappendf (&b, format, arglist);
+    va_end ( arglist );
+    f_strbuf_append_c (&b, '\n');
+    if (show)
+        _emit (F_OUT_DEBUG, b.buf, b.len);
+    else
+        _flight_record (b.buf, b.len);
+    f_strbuf_free (&b);
+}
+
+void _err () {
+    // so the message which got us here isn't lost.
+    f_async_flush ();
+    if (_flight_on)
+        f_flight_dump (STDERR_FILENO);
+    fish_util_cleanup ();
+    exit (1);
+}
+
+void f_sys_die (bool b) {
+    _die = b;
+}
+
+void f_verbose_cmds (bool b) {
+    _verbose = b;
+}
+
+/* Non-null FILE means the pipe and spawn succeeded, but command could
+ * still fail (e.g. command not found).
+ * Caller should check for NULL, and if non-null, call sysclose to finish
+ * (not free ()).
+ *
+ * Run by /bin/sh, spawned rather than popen'ed, so sysclose knows the pid
+ * (for f_sys_timeout and f_sys_last_usage).
+ */
+FILE *sysr (const char *cmd) {
+    if (_coproc_on)
+        return _coproc_sysr (cmd);
+    char *argv[] = { "/bin/sh", "-c", (char *) cmd, NULL };
+    return _sysv_open (argv, cmd, true);
+}
+
+FILE *sysw (const char *cmd) {
+    char *argv[] = { "/bin/sh", "-c", (char *) cmd, NULL };
+    return _sysv_open (argv, cmd, false);
+}
+
+void f_sys_timeout (double secs, double grace) {
+    _sys_timeout_ms = secs > 0 ? secs * 1000 : 0;
+    _sys_grace_ms = grace > 0 ? grace * 1000 : 0;
+}
+
+bool f_sys_last_usage (struct f_sys_usage *usage) {
+    if (!_sys_usage_set)
+        return false;
+    *usage = _sys_usage;
+    return true;
+}
+
+static double _elapsed (const struct timespec *start) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* ms until the command started at start times out: -1 if there's no
+ * timeout, 0 if it's up.
+ */
+static long _sys_left_ms (const struct timespec *start) {
+    if (!_sys_timeout_ms)
+        return -1;
+    long left = _sys_timeout_ms - (long) (_elapsed (start) * 1000);
+    return left > 0 ? left : 0;
+}
+
+static int _pidfd_open (pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall (SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Wait up to ms (-1: forever) for pid to exit, without reaping it. False
+ * if it didn't, or we couldn't tell: the caller kills it then.
+ */
+static bool _sys_wait_exit (pid_t pid, long ms) {
+    int pidfd = _pidfd_open (pid);
+    if (pidfd != -1) {
+        struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+        int rc;
+        while ((rc = poll (&pfd, 1, ms)) == -1 && errno == EINTR)
+            ;
+        close (pidfd);
+        return rc > 0;
+    }
+    // no pidfd: look every 10 ms.
+    while (1) {
+        siginfo_t info = { 0 };
+        // ECHILD: it's gone already.
+        if (waitid (P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 && errno != EINTR)
+            return errno == ECHILD;
+        if (info.si_pid)
+            return true;
+        if (!ms)
+            return false;
+        long step = ms == -1 || ms > 10 ? 10 : ms;
+        struct timespec ts = { 0, step * 1000000 };
+        nanosleep (&ts, NULL);
+        if (ms != -1)
+            ms -= step;
+    }
+}
+
+/* SIGTERM, then SIGKILL after the grace period.
+ */
+static void _sys_kill (pid_t pid) {
+    kill (pid, SIGTERM);
+    if (!_sys_wait_exit (pid, _sys_grace_ms))
+        kill (pid, SIGKILL);
+}
+
+/* Reap pid with wait4 and note its usage. Returns the wait status, or -1.
+ */
+static int _sys_reap (pid_t pid, const struct timespec *start, bool timed_out, struct f_sys_usage *usage) {
+    int status;
+    struct rusage ru = { 0 };
+    while (wait4 (pid, &status, 0, &ru) == -1) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    struct f_sys_usage u = {
+        .wall = _elapsed (start),
+        .user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+        .sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+        .maxrss = ru.ru_maxrss,
+        .minflt = ru.ru_minflt,
+        .majflt = ru.ru_majflt,
+        .nvcsw = ru.ru_nvcsw,
+        .nivcsw = ru.ru_nivcsw,
+        .timed_out = timed_out,
+    };
+    _sys_usage = u;
+    _sys_usage_set = true;
+    if (usage)
+        *usage = u;
+    return status;
+}
+
+/* Wait for pid, killing it if it runs past the timeout.
+ */
+static int _sys_wait (pid_t pid, const struct timespec *start, bool *timed_out) {
+    *timed_out = false;
+    long left = _sys_left_ms (start);
+    if (left != -1 && !_sys_wait_exit (pid, left)) {
+        _sys_kill (pid);
+        *timed_out = true;
+    }
+    return _sys_reap (pid, start, *timed_out, NULL);
+}
+
+static int _sys_timed_out (const char *cmd, int flags) {
+    _ ();
+    if (cmd && *cmd != '\0') {
+        BR (cmd);
+        spr (" «%s»", _s);
+    }
+    else {
+        spr ("");
+        spr ("");
+    }
+    spr ("%.1f", _sys_timeout_ms / 1000.0);
+    Y (_u);
+    char *msg = spr_ ("Cmd%s timed out after %s s.", 300, _t, _v);
+    if (_die)
+        err (msg);
+    else if (! (flags & F_QUIET))
+        warn (msg);
+    f_free (msg);
+    return F_SYS_TIMEOUT;
+}
+
+/* 0 means good, -1 means wait or another sys call failed, > 0 is a non-zero
+ * exit from the command.
+ * The cmd arg is optional -- with it we can make a nicer error message.
+ *
+ * This will print an error message if a popen'ed command is closed while
+ * there's still data in the buffer. Use flag F_QUIET to silence this.
+ */
+int sysclose_f (FILE *f, const char *cmd, int flags) {
+    struct sys_child child;
+    int status;
+    if (_sys_child_take (f, &child) && child.pid == -1) {
+        fclose (f);
+        f_free (child.buf);
+        if (child.status == F_SYS_TIMEOUT)
+            return _sys_timed_out (cmd, flags);
+        status = child.status;
+    }
+    else if (child.pid) {
+        fclose (f);
+        bool timed_out;
+        status = _sys_wait (child.pid, &child.start, &timed_out);
+        if (timed_out)
+            return _sys_timed_out (cmd, flags);
+    }
+    else
+        status = pclose (f);
+    return _sys_status (status, cmd, flags);
+}
+
+/* Decode and complain about a wait status (or -1), for sysclose_f and
+ * friends.
+ */
+static int _sys_status (int status, const char *cmd, int flags) {
+    bool quiet = flags & F_QUIET;
+    if (status) {
+        int en = errno;
+        _ ();
+        if (cmd && *cmd != '\0') {
+            BR (cmd);
+            spr (" «%s»", _s);
+        }
+        else {
+            spr ("");
+            spr ("");
+        }
+        /* On linux and most unices, the 7 least significant bits contain
+         * the signal, and the 8th tells us if we core dumped, if it was
+         * killed by a signal.
+         * We will assume we are on one of those systems.
+         */
+        int signal = status & 0x7F;
+        int core_dumped = status & 0x80;
+        if (signal) {
+            char *name;
+            f_signame (signal, &name, NULL);
+            CY (name);
+            spr (" «got signal %s»", _u);
+        }
+        else {
+            spr ("");
+            spr ("");
+        }
+        if (core_dumped) {
+            M ("core dumped");
+            spr (" «%s»", _w);
+        }
+        else {
+            spr ("");
+            spr ("");
+        }
+
+        status >>= 8;
+        spr ("%d", status);
+        Y (_y);
+        // XX
+        char *msg = spr_ ("Error closing cmd%s «exit status %s»%s%s.", 300, _t, _z, _v, _x);
+        if (status == -1) {
+            errno = en;
+            if (_die)
+                err_perr (msg);
+            else if (!quiet)
+                warn_perr (msg);
+        }
+        else {
+            if (_die)
+                err (msg);
+            else if (!quiet)
+                warn (msg);
+        }
+        f_free (msg);
+    }
+    return status;
+}
+
+int sysclose (FILE *f) {
+    return sysclose_f (f, NULL, 0);
+}
+
+static void _sys_child_add (FILE *f, pid_t pid, const struct timespec *start) {
+    pthread_mutex_lock (&_sys_lock);
+    if (_sys_children_num == _sys_children_cap) {
+        _sys_children_cap = _sys_children_cap ? _sys_children_cap * 2 : 8;
+        _sys_children = f_realloc (_sys_children, _sys_children_cap * sizeof (*_sys_children));
+    }
+    _sys_children[_sys_children_num].f = f;
+    _sys_children[_sys_children_num].pid = pid;
+    _sys_children[_sys_children_num].start = *start;
+    _sys_children[_sys_children_num].status = 0;
+    _sys_children[_sys_children_num].buf = NULL;
+    _sys_children_num++;
+    pthread_mutex_unlock (&_sys_lock);
+}
+
+/* 0 if it's not ours (popen).
+ */
+static pid_t _sys_child_find (FILE *f, struct timespec *start) {
+    pid_t pid = 0;
+    pthread_mutex_lock (&_sys_lock);
+    for (int i = 0; i < _sys_children_num; i++) {
+        if (_sys_children[i].f != f)
+            continue;
+        pid = _sys_children[i].pid;
+        if (start)
+            *start = _sys_children[i].start;
+        break;
+    }
+    pthread_mutex_unlock (&_sys_lock);
+    return pid;
+}
+
+/* Removes f's entry into child; false if it's not ours (popen), with
+ * child->pid 0.
+ */
+static bool _sys_child_take (FILE *f, struct sys_child *child) {
+    child->pid = 0;
+    bool found = false;
+    pthread_mutex_lock (&_sys_lock);
+    for (int i = 0; i < _sys_children_num; i++) {
+        if (_sys_children[i].f != f)
+            continue;
+        *child = _sys_children[i];
+        _sys_children[i] = _sys_children[--_sys_children_num];
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock (&_sys_lock);
+    return found;
+}
+
+/* Same for a sysrw child, by pid. The newest entry wins, in case the pid
+ * got reused.
+ */
+static bool _sys_child_take_pid (pid_t pid, struct sys_child *child) {
+    child->buf = NULL;
+    bool found = false;
+    pthread_mutex_lock (&_sys_lock);
+    for (int i = _sys_children_num - 1; i >= 0; i--) {
+        if (_sys_children[i].f || _sys_children[i].pid != pid)
+            continue;
+        *child = _sys_children[i];
+        _sys_children[i] = _sys_children[--_sys_children_num];
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock (&_sys_lock);
+    return found;
+}
+
+/* Pid of a command started by sysv_r / sysv_w, 0 for anything else.
+ */
+pid_t f_sys_pid (FILE *f) {
+    pid_t pid = _sys_child_find (f, NULL);
+    return pid == -1 ? 0 : pid;
+}
+
+void f_sys_path_cache (bool b) {
+    _path_cache_on = b;
+}
+
+static void _path_cache_free () {
+    for (int i = 0; i < _path_cache_num; i++) {
+        f_free (_path_cache[i].name);
+        f_free (_path_cache[i].full);
+    }
+    _path_cache_num = 0;
+    f_free (_path_cache_path);
+    _path_cache_path = NULL;
+}
+
+/* Full path of name from PATH, cached. NULL if not found (leave it to
+ * posix_spawnp then). A hit in an empty or relative PATH entry depends on
+ * the cwd, so that's not cached either and also returns NULL. Caller
+ * holds _sys_lock.
+ */
+static const char *_path_lookup (const char *name) {
+    const char *path = getenv ("PATH");
+    if (!path)
+        return NULL;
+    if (!_path_cache_path || strcmp (path, _path_cache_path)) {
+        _path_cache_free ();
+        _path_cache_path = f_strdup (path);
+    }
+    for (int i = 0; i < _path_cache_num; i++)
+        if (!strcmp (_path_cache[i].name, name))
+            return _path_cache[i].full;
+
+    f_strbuf b;
+    f_strbuf_init (&b);
+    const char *full = NULL;
+    while (*path) {
+        const char *end = strchrnul (path, ':');
+        f_strbuf_truncate (&b, 0);
+        // empty entry means cwd.
+        if (end == path)
+            f_strbuf_append_c (&b, '.');
+        else
+            f_strbuf_append_n (&b, path, end - path);
+        f_strbuf_append_c (&b, '/');
+        f_strbuf_append (&b, name);
+        if (!access (b.buf, X_OK)) {
+            if (*b.buf == '/')
+                full = b.buf;
+            break;
+        }
+        path = *end ? end + 1 : end;
+    }
+    if (full && _path_cache_num < PATH_CACHE_SIZE) {
+        _path_cache[_path_cache_num].name = f_strdup (name);
+        _path_cache[_path_cache_num].full = f_strdup (full);
+        full = _path_cache[_path_cache_num++].full;
+    }
+    else
+        full = NULL;
+    f_strbuf_free (&b);
+    return full;
+}
+
+static void _argv_join (f_strbuf *b, char *const argv[]) {
+    for (int i = 0; argv[i]; i++) {
+        if (i)
+            f_strbuf_append_c (b, ' ');
+        f_strbuf_append (b, argv[i]);
+    }
+}
+
+/* posix_spawn(p) with our attributes and the PATH cache. Returns 0 or an
+ * errno value.
+ */
+static int _spawn_f (pid_t *pid, char *const argv[], const posix_spawn_file_actions_t *fa, short flags) {
+    posix_spawnattr_t attr;
+    posix_spawnattr_init (&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    // POSIX_SPAWN_SETPGROUP: with the default pgroup 0, its own group.
+    posix_spawnattr_setflags (&attr, flags);
+    // the cache entry can go if PATH changes: copy.
+    char full[PATH_MAX] = "";
+    if (_path_cache_on && !strchr (argv[0], '/')) {
+        pthread_mutex_lock (&_sys_lock);
+        const char *p = _path_lookup (argv[0]);
+        if (p && strlen (p) < PATH_MAX)
+            strcpy (full, p);
+        pthread_mutex_unlock (&_sys_lock);
+    }
+    extern char **environ;
+    int rc;
+    if (*full)
+        rc = posix_spawn (pid, full, fa, &attr, argv, environ);
+    else
+        rc = posix_spawnp (pid, argv[0], fa, &attr, argv, environ);
+    posix_spawnattr_destroy (&attr);
+    return rc;
+}
+
+static int _spawn (pid_t *pid, char *const argv[], const posix_spawn_file_actions_t *fa) {
+    return _spawn_f (pid, argv, fa, 0);
+}
+
+static void _sys_launch_failed (const char *cmd, const char *what, int rc) {
+    _ ();
+    BR (cmd);
+    spr ("Can't launch cmd (%s) for %s.", _s, what);
+    errno = rc;
+    if (_die)
+        err_perr (_t);
+    else
+        warn_perr (_t);
+}
+
+/* The child gets one end of a pipe as stdout (reading) or stdin
+ * (writing); we keep the other as a FILE.
+ */
+static FILE *_sysv_open (char *const argv[], const char *cmd, bool reading) {
+    if (_verbose) _sys_say (cmd);
+
+    FILE *f = NULL;
+    int fds[2];
+    int rc;
+    if (pipe2 (fds, O_CLOEXEC))
+        rc = errno;
+    else {
+        int ours = reading ? fds[0] : fds[1];
+        int theirs = reading ? fds[1] : fds[0];
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init (&fa);
+        // dup2 clears close-on-exec on the new fd.
+        posix_spawn_file_actions_adddup2 (&fa, theirs, reading ? STDOUT_FILENO : STDIN_FILENO);
+        pid_t pid;
+        struct timespec start;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        rc = _spawn (&pid, argv, &fa);
+        posix_spawn_file_actions_destroy (&fa);
+        close (theirs);
+        if (rc)
+            close (ours);
+        else {
+            f = fdopen (ours, reading ? "r" : "w");
+            if (!f) {
+                rc = errno;
+                close (ours);
+                waitpid (pid, NULL, 0);
+            }
+            else
+                _sys_child_add (f, pid, &start);
+        }
+    }
+
+    if (!f)
+        _sys_launch_failed (cmd, reading ? "reading" : "writing", rc);
+    return f;
+}
+
+static FILE *_sysv_open_argv (char *const argv[], bool reading) {
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    FILE *f = _sysv_open (argv, cmd.buf, reading);
+    f_strbuf_free (&cmd);
+    return f;
+}
+
+FILE *sysv_r (char *const argv[]) {
+    return _sysv_open_argv (argv, true);
+}
+
+FILE *sysv_w (char *const argv[]) {
+    return _sysv_open_argv (argv, false);
+}
+
+/* Like sys: run argv and read its output until EOF.
+ */
+int sysv (char *const argv[]) {
+    FILE *f = sysv_r (argv);
+    if (!f)
+        return -1;
+    _sys_drain (f);
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    int rc = sysclose_f (f, cmd.buf, 0);
+    f_strbuf_free (&cmd);
+    return rc;
+}
+
+/* One read of fd into b, as long as it stays under max (0: no limit);
+ * anything more is read and thrown away. Returns what read did: 0 at EOF,
+ * -1 with EAGAIN if a non-blocking fd is empty.
+ */
+static ssize_t _capture_read (int fd, f_strbuf *b, size_t max, size_t chunk) {
+    char discard[4096];
+    ssize_t n;
+    do {
+        if (max && b->len >= max)
+            n = read (fd, discard, sizeof (discard));
+        else {
+            size_t want = chunk;
+            if (max && max - b->len < want)
+                want = max - b->len;
+            f_strbuf_reserve (b, want);
+            n = read (fd, b->buf + b->len, want);
+            if (n > 0) {
+                b->len += n;
+                b->buf[b->len] = '\0';
+            }
+        }
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && errno != EAGAIN)
+        warn_perr ("Interrupted read from command");
+    return n;
+}
+
+static int _capture (char *const argv[], const char *cmd, f_strbuf *out, f_strbuf *err, size_t max, int flags) {
+    if (_verbose) _sys_say (cmd);
+
+    bool merge = err == out;
+    int ofd[2], efd[2] = { -1, -1 };
+    if (pipe2 (ofd, O_CLOEXEC)) {
+        _sys_launch_failed (cmd, "reading", errno);
+        return -1;
+    }
+    if (err && !merge && pipe2 (efd, O_CLOEXEC)) {
+        _sys_launch_failed (cmd, "reading", errno);
+        close (ofd[0]);
+        close (ofd[1]);
+        return -1;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_adddup2 (&fa, ofd[1], STDOUT_FILENO);
+    if (merge)
+        posix_spawn_file_actions_adddup2 (&fa, ofd[1], STDERR_FILENO);
+    else if (err)
+        posix_spawn_file_actions_adddup2 (&fa, efd[1], STDERR_FILENO);
+    pid_t pid;
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    int rc = _spawn (&pid, argv, &fa);
+    posix_spawn_file_actions_destroy (&fa);
+    close (ofd[1]);
+    if (efd[1] != -1)
+        close (efd[1]);
+    if (rc) {
+        close (ofd[0]);
+        if (efd[0] != -1)
+            close (efd[0]);
+        _sys_launch_failed (cmd, "reading", rc);
+        return -1;
+    }
+
+    // read a pipe's worth at a time.
+    int pipe_size = fcntl (ofd[0], F_GETPIPE_SZ);
+    size_t chunk = pipe_size > 65536 ? pipe_size : 65536;
+
+    struct pollfd pfd[2] = {
+        { .fd = ofd[0], .events = POLLIN },
+        { .fd = efd[0], .events = POLLIN },
+    };
+    int open_fds = efd[0] == -1 ? 1 : 2;
+    // only one pipe and no timeout: just block in read.
+    if (efd[0] == -1 && !_sys_timeout_ms) {
+        while (_capture_read (ofd[0], out, max, chunk) > 0)
+            ;
+        open_fds = 0;
+    }
+    bool timed_out = false;
+    while (open_fds) {
+        int rc = poll (pfd, 2, _sys_left_ms (&start));
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            warn_perr ("Couldn't poll command output");
+            break;
+        }
+        // stop reading: something it started could keep the pipes open.
+        if (!rc) {
+            _sys_kill (pid);
+            timed_out = true;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfd[i].fd == -1 || !pfd[i].revents)
+                continue;
+            if (_capture_read (pfd[i].fd, i ? err : out, max, chunk) <= 0) {
+                close (pfd[i].fd);
+                pfd[i].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++)
+        if (pfd[i].fd != -1)
+            close (pfd[i].fd);
+
+    int status;
+    if (timed_out) {
+        _sys_reap (pid, &start, true, NULL);
+        return _sys_timed_out (cmd, flags);
+    }
+    status = _sys_wait (pid, &start, &timed_out);
+    if (timed_out)
+        return _sys_timed_out (cmd, flags);
+    return _sys_status (status, cmd, flags);
+}
+
+/* Run argv and append its stdout to out (initialised by the caller).
+ * With err, stderr goes there (err == out to merge them). At most max
+ * bytes are kept in each (0: no limit); the rest is read and dropped.
+ * Returns the status as sysclose_f does, or -1 if it couldn't start.
+ */
+int sysv_capture_f (char *const argv[], f_strbuf *out, f_strbuf *err, size_t max, int flags) {
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    int rc = _capture (argv, cmd.buf, out, err, max, flags);
+    f_strbuf_free (&cmd);
+    return rc;
+}
+
+int sysv_capture (char *const argv[], f_strbuf *out) {
+    return sysv_capture_f (argv, out, NULL, 0, 0);
+}
+
+/* Same, with cmd run by /bin/sh.
+ */
+int sys_capture_f (const char *cmd, f_strbuf *out, f_strbuf *err, size_t max, int flags) {
+    // the coprocess shell only has the one output stream.
+    if (_coproc_on && !err)
+        return _coproc_sys (cmd, out, max, flags);
+    char *argv[] = { "/bin/sh", "-c", (char *) cmd, NULL };
+    return _capture (argv, cmd, out, err, max, flags);
+}
+
+int sys_capture (const char *cmd, f_strbuf *out) {
+    return sys_capture_f (cmd, out, NULL, 0, 0);
+}
+
+static pid_t _sysrw (char *const argv[], const char *cmd, int *in_fd, int *out_fd) {
+    if (_verbose) _sys_say (cmd);
+    int ifd[2], ofd[2];
+    if (pipe2 (ifd, O_CLOEXEC)) {
+        _sys_launch_failed (cmd, "reading and writing", errno);
+        return -1;
+    }
+    if (pipe2 (ofd, O_CLOEXEC)) {
+        _sys_launch_failed (cmd, "reading and writing", errno);
+        close (ifd[0]);
+        close (ifd[1]);
+        return -1;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_adddup2 (&fa, ifd[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2 (&fa, ofd[1], STDOUT_FILENO);
+    pid_t pid;
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    int rc = _spawn (&pid, argv, &fa);
+    posix_spawn_file_actions_destroy (&fa);
+    close (ifd[0]);
+    close (ofd[1]);
+    if (rc) {
+        close (ifd[1]);
+        close (ofd[0]);
+        _sys_launch_failed (cmd, "reading and writing", rc);
+        return -1;
+    }
+    // for sysrw_pump's messages.
+    _sys_child_add (NULL, pid, &start);
+    pthread_mutex_lock (&_sys_lock);
+    _sys_children[_sys_children_num - 1].buf = f_strdup (cmd);
+    pthread_mutex_unlock (&_sys_lock);
+    fcntl (ifd[1], F_SETFL, O_NONBLOCK);
+    fcntl (ofd[0], F_SETFL, O_NONBLOCK);
+    *in_fd = ifd[1];
+    *out_fd = ofd[0];
+    return pid;
+}
+
+pid_t sysrw (const char *cmd, int *in_fd, int *out_fd) {
+    char *argv[] = { "/bin/sh", "-c", (char *) cmd, NULL };
+    return _sysrw (argv, cmd, in_fd, out_fd);
+}
+
+pid_t sysv_rw (char *const argv[], int *in_fd, int *out_fd) {
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    pid_t pid = _sysrw (argv, cmd.buf, in_fd, out_fd);
+    f_strbuf_free (&cmd);
+    return pid;
+}
+
+/* Write as much of in as the pipe takes. Returns bytes written, 0 if full,
+ * -1 on error (EPIPE: the command stopped reading).
+ */
+static ssize_t _pump_write (int fd, const char *in, size_t len, bool splice) {
+    ssize_t n;
+    do {
+        if (splice) {
+            struct iovec v = { (char *) in, len };
+            n = vmsplice (fd, &v, 1, SPLICE_F_NONBLOCK);
+        }
+        else
+            n = write (fd, in, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && errno == EAGAIN)
+        return 0;
+    return n;
+}
+
+int sysrw_pump (pid_t pid, int in_fd, int out_fd, const char *in, size_t in_len, f_strbuf *out, int flags) {
+    // a command which exits without reading all its input would give us
+    // SIGPIPE: block it and take any pending one back afterwards.
+    sigset_t pipe_set, old_set;
+    sigemptyset (&pipe_set);
+    sigaddset (&pipe_set, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &pipe_set, &old_set);
+
+    bool splice = flags & F_SPLICE;
+    bool timed_out = false;
+    struct sys_child child;
+    if (!_sys_child_take_pid (pid, &child))
+        clock_gettime (CLOCK_MONOTONIC, &child.start);
+    const char *cmd = child.buf;
+    struct timespec start = child.start;
+    f_strbuf discard;
+    f_strbuf_init (&discard);
+    size_t done = 0;
+    if (!in_len) {
+        close (in_fd);
+        in_fd = -1;
+    }
+    while (in_fd != -1 || out_fd != -1) {
+        struct pollfd pfd[2] = {
+            { .fd = in_fd, .events = POLLOUT },
+            { .fd = out_fd, .events = POLLIN },
+        };
+        int rc = poll (pfd, 2, _sys_left_ms (&start));
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            warn_perr ("Couldn't poll command");
+            break;
+        }
+        if (!rc) {
+            _sys_kill (pid);
+            timed_out = true;
+            break;
+        }
+        if (in_fd != -1 && pfd[0].revents) {
+            ssize_t n = _pump_write (in_fd, in + done, in_len - done, splice);
+            if (n == -1 && errno != EPIPE)
+                warn_perr ("Couldn't write to command");
+            if (n > 0)
+                done += n;
+            if (n == -1 || done == in_len) {
+                close (in_fd);
+                in_fd = -1;
+            }
+        }
+        if (out_fd != -1 && pfd[1].revents) {
+            f_strbuf *b = out ? out : &discard;
+            ssize_t n;
+            do {
+                if (!out)
+                    f_strbuf_truncate (&discard, 0);
+                n = _capture_read (out_fd, b, 0, 65536);
+            } while (n > 0);
+            // EAGAIN: drained for now.
+            if (n == 0 || errno != EAGAIN) {
+                close (out_fd);
+                out_fd = -1;
+            }
+        }
+    }
+    f_strbuf_free (&discard);
+    if (in_fd != -1)
+        close (in_fd);
+    if (out_fd != -1)
+        close (out_fd);
+
+    struct timespec zero = { 0, 0 };
+    sigtimedwait (&pipe_set, NULL, &zero);
+    pthread_sigmask (SIG_SETMASK, &old_set, NULL);
+
+    int ret;
+    if (timed_out) {
+        _sys_reap (pid, &start, true, NULL);
+        ret = _sys_timed_out (cmd, flags);
+    }
+    else {
+        int status = _sys_wait (pid, &start, &timed_out);
+        ret = timed_out ? _sys_timed_out (cmd, flags) : _sys_status (status, cmd, flags);
+    }
+    f_free (child.buf);
+    return ret;
+}
+
+/* Coprocess shell (f_sys_coproc). For each command we send
+ *
+ *   ( cd '<cwd>' && eval '<cmd>' ) </dev/null 3>&- & echo $! >&3;
+ *   wait $! 2>/dev/null; echo $? >&3
+ *
+ * and read its output from the shell's stdout until its status shows up
+ * on fd 3. The shell gets its own process group, so a timeout can take
+ * out the command and whatever it started (and the shell: the next
+ * command gets a new one).
+ */
+static pid_t _coproc_pid = 0;
+static int _coproc_in = -1;
+static int _coproc_out = -1;
+static int _coproc_st = -1;
+// hash of the environment the shell was started with.
+static unsigned long _coproc_env = 0;
+static pthread_mutex_t _coproc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void f_sys_coproc (bool b) {
+    _coproc_on = b;
+    if (!b)
+        f_sys_coproc_stop ();
+}
+
+static void _coproc_close_fds () {
+    close (_coproc_in);
+    close (_coproc_out);
+    close (_coproc_st);
+    _coproc_in = _coproc_out = _coproc_st = -1;
+}
+
+/* Caller holds _coproc_lock.
+ */
+static void _coproc_close () {
+    if (!_coproc_pid)
+        return;
+    _coproc_close_fds ();
+    while (waitpid (_coproc_pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+    _coproc_pid = 0;
+}
+
+void f_sys_coproc_stop () {
+    pthread_mutex_lock (&_coproc_lock);
+    _coproc_close ();
+    pthread_mutex_unlock (&_coproc_lock);
+}
+
+static unsigned long _env_hash () {
+    extern char **environ;
+    unsigned long hash = 0;
+    for (char **e = environ; e && *e; e++)
+        hash = hash * 31 + _intern_hash (*e, strlen (*e));
+    return hash;
+}
+
+static bool _coproc_start () {
+    int in[2], out[2], st[2];
+    if (pipe2 (in, O_CLOEXEC))
+        return false;
+    if (pipe2 (out, O_CLOEXEC)) {
+        close (in[0]);
+        close (in[1]);
+        return false;
+    }
+    if (pipe2 (st, O_CLOEXEC)) {
+        close (in[0]);
+        close (in[1]);
+        close (out[0]);
+        close (out[1]);
+        return false;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_adddup2 (&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2 (&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2 (&fa, st[1], 3);
+    char *argv[] = { "/bin/sh", NULL };
+    int rc = _spawn_f (&_coproc_pid, argv, &fa, POSIX_SPAWN_SETPGROUP);
+    posix_spawn_file_actions_destroy (&fa);
+    close (in[0]);
+    close (out[1]);
+    close (st[1]);
+    if (rc) {
+        _coproc_pid = 0;
+        close (in[1]);
+        close (out[0]);
+        close (st[0]);
+        errno = rc;
+        return false;
+    }
+    fcntl (out[0], F_SETFL, O_NONBLOCK);
+    _coproc_in = in[1];
+    _coproc_out = out[0];
+    _coproc_st = st[0];
+    _coproc_env = _env_hash ();
+    return true;
+}
+
+/* Timed out: SIGTERM the shell's process group, and SIGKILL it if it's
+ * not all gone after the grace period. The command isn't our child, so
+ * we can't wait for it: we look for the group with kill 0. Leaves the fds
+ * for the caller to drain and close. Caller holds _coproc_lock.
+ */
+static void _coproc_kill () {
+    pid_t pg = _coproc_pid;
+    bool reaped = false;
+    kill (-pg, SIGTERM);
+    for (long ms = 0; ; ms += 10) {
+        // the shell's zombie would keep the group around.
+        if (!reaped && waitpid (pg, NULL, WNOHANG) == pg)
+            reaped = true;
+        if (reaped && kill (-pg, 0) == -1 && errno == ESRCH)
+            break;
+        if (ms >= _sys_grace_ms) {
+            kill (-pg, SIGKILL);
+            break;
+        }
+        struct timespec ts = { 0, 10000000 };
+        nanosleep (&ts, NULL);
+    }
+    if (!reaped)
+        while (waitpid (pg, NULL, 0) == -1 && errno == EINTR)
+            ;
+    _coproc_pid = 0;
+}
+
+static bool _write_all (int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write (fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void _sh_quote (f_strbuf *b, const char *s) {
+    f_strbuf_append_c (b, '\'');
+    for (const char *c = s; *c; c++) {
+        if (*c == '\'')
+            f_strbuf_append (b, "'\\''");
+        else
+            f_strbuf_append_c (b, *c);
+    }
+    f_strbuf_append_c (b, '\'');
+}
+
+/* Send script to the shell and collect the output and status. Returns the
+ * wait status, or -1 if the shell went away (it's closed then, and
+ * *started says whether the command had got going). Caller holds
+ * _coproc_lock.
+ */
+static int _coproc_once (const f_strbuf *script, f_strbuf *out, size_t max, bool *timed_out, bool *started) {
+    *started = false;
+    // the shell might have gone away.
+    sigset_t pipe_set, old_set;
+    sigemptyset (&pipe_set);
+    sigaddset (&pipe_set, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &pipe_set, &old_set);
+    bool ok = _write_all (_coproc_in, script->buf, script->len);
+    struct timespec zero = { 0, 0 };
+    sigtimedwait (&pipe_set, NULL, &zero);
+    pthread_sigmask (SIG_SETMASK, &old_set, NULL);
+
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    f_strbuf discard;
+    f_strbuf_init (&discard);
+    f_strbuf *b = out ? out : &discard;
+    // pid, then status.
+    char line[64];
+    int line_len = 0;
+    long vals[2];
+    int nvals = 0;
+    while (ok && nvals < 2) {
+        struct pollfd pfd[2] = {
+            { .fd = _coproc_out, .events = POLLIN },
+            { .fd = _coproc_st, .events = POLLIN },
+        };
+        int rc = poll (pfd, 2, _sys_left_ms (&start));
+        if (rc == -1) {
+            ok = errno == EINTR;
+            continue;
+        }
+        if (!rc) {
+            *timed_out = *started = true;
+            _coproc_kill ();
+            break;
+        }
+        if (pfd[0].revents) {
+            if (!out)
+                f_strbuf_truncate (&discard, 0);
+            ssize_t n = _capture_read (_coproc_out, b, max, 65536);
+            if (n > 0)
+                *started = true;
+            if (!n)
+                ok = false;
+        }
+        if (pfd[1].revents) {
+            ssize_t n = read (_coproc_st, line + line_len, sizeof (line) - 1 - line_len);
+            if (n <= 0) {
+                ok = n == -1 && errno == EINTR;
+                continue;
+            }
+            line_len += n;
+            char *nl;
+            while (nvals < 2 && (nl = memchr (line, '\n', line_len))) {
+                *nl = '\0';
+                vals[nvals++] = atol (line);
+                line_len -= nl + 1 - line;
+                memmove (line, nl + 1, line_len);
+                *started = true;
+            }
+        }
+    }
+    // all it wrote is in the pipe by now (or it was killed).
+    if (ok || *timed_out)
+        while (_capture_read (_coproc_out, b, max, 65536) > 0) {
+            if (!out)
+                f_strbuf_truncate (&discard, 0);
+        }
+    f_strbuf_free (&discard);
+
+    struct f_sys_usage u = { .wall = _elapsed (&start), .timed_out = *timed_out };
+    _sys_usage = u;
+    _sys_usage_set = true;
+
+    if (*timed_out) {
+        _coproc_close_fds ();
+        return 0;
+    }
+    if (!ok) {
+        _coproc_close ();
+        errno = EPIPE;
+        return -1;
+    }
+    // $?, as /bin/sh -c would have exited with it.
+    return (vals[1] & 0xff) << 8;
+}
+
+/* Run cmd in the coprocess, its output into out (NULL: drop it). Returns
+ * the status as a wait status, or -1 if the shell couldn't be used.
+ */
+static int _coproc_run (const char *cmd, f_strbuf *out, size_t max, bool *timed_out) {
+    *timed_out = false;
+    // the shell keeps its own cwd: the command gets ours.
+    char cwd[PATH_MAX];
+    if (!getcwd (cwd, sizeof (cwd)))
+        return -1;
+    f_strbuf script;
+    f_strbuf_init (&script);
+    f_strbuf_append (&script, "( cd ");
+    _sh_quote (&script, cwd);
+    f_strbuf_append (&script, " && eval ");
+    _sh_quote (&script, cmd);
+    f_strbuf_append (&script, " ) </dev/null 3>&- & echo $! >&3; wait $! 2>/dev/null; echo $? >&3\n");
+
+    pthread_mutex_lock (&_coproc_lock);
+    // and the environment it was started with.
+    if (_coproc_pid && _coproc_env != _env_hash ())
+        _coproc_close ();
+    int status = -1;
+    bool started = false;
+    // a shell which died gets restarted once, if the command didn't get
+    // going.
+    for (int tries = 0; tries < 2 && !started; tries++) {
+        if (!_coproc_pid && !_coproc_start ())
+            break;
+        status = _coproc_once (&script, out, max, timed_out, &started);
+        if (status != -1)
+            break;
+    }
+    int en = errno;
+    pthread_mutex_unlock (&_coproc_lock);
+    f_strbuf_free (&script);
+    errno = en;
+    return status;
 }
 
-void R (const char *s) {
-    char *c = _color (s, RED);
-    _color_static (c);
-    free (c);
+/* The coprocess version of sys_capture_f / sys.
+ */
+static int _coproc_sys (const char *cmd, f_strbuf *out, size_t max, int flags) {
+    if (_verbose) _sys_say (cmd);
+    bool timed_out;
+    int status = _coproc_run (cmd, out, max, &timed_out);
+    if (status == -1) {
+        _sys_launch_failed (cmd, "reading", errno);
+        return -1;
+    }
+    if (timed_out)
+        return _sys_timed_out (cmd, flags);
+    return _sys_status (status, cmd, flags);
 }
 
-void BR (const char *s) {
-    char *c = _color (s, BRIGHT_RED);
-    _color_static (c);
-    free (c);
+/* A FILE over a copy of buf with a real fd behind it (unlike fmemopen):
+ * fileno works, and NULs are fine.
+ */
+static FILE *_mem_file (const char *buf, size_t len) {
+    int fd = -1;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create ("sysr", MFD_CLOEXEC);
+#endif
+    FILE *f = fd == -1 ? tmpfile () : fdopen (fd, "w+");
+    if (!f) {
+        if (fd != -1)
+            close (fd);
+        return NULL;
+    }
+    fcntl (fileno (f), F_SETFD, FD_CLOEXEC);
+    if (len && fwrite (buf, 1, len, f) != len) {
+        fclose (f);
+        return NULL;
+    }
+    rewind (f);
+    return f;
 }
 
-void G (const char *s) {
-    char *c = _color (s, GREEN);
-    _color_static (c);
-    free (c);
+/* sysr in coprocess mode: run it to the end, and give a FILE over the
+ * output. sysclose_f finds the status in _sys_children.
+ */
+static FILE *_coproc_sysr (const char *cmd) {
+    if (_verbose) _sys_say (cmd);
+    f_strbuf out;
+    f_strbuf_init (&out);
+    bool timed_out;
+    int status = _coproc_run (cmd, &out, 0, &timed_out);
+    if (status == -1) {
+        f_strbuf_free (&out);
+        _sys_launch_failed (cmd, "reading", errno);
+        return NULL;
+    }
+    FILE *f = _mem_file (out.buf, out.len);
+    f_strbuf_free (&out);
+    if (!f) {
+        _sys_launch_failed (cmd, "reading", errno);
+        return NULL;
+    }
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    _sys_child_add (f, -1, &start);
+    pthread_mutex_lock (&_sys_lock);
+    _sys_children[_sys_children_num - 1].status = timed_out ? F_SYS_TIMEOUT : status;
+    pthread_mutex_unlock (&_sys_lock);
+    return f;
 }
 
-void BG (const char *s) {
-    char *c = _color (s, BRIGHT_GREEN);
-    _color_static (c);
-    free (c);
-}
+/* Pipelines.
+ */
+struct pipeline_stage {
+    char **argv; // owned
+    char *cmd;
+    pid_t pid; // 0: not started
+    int status;
+    bool timed_out;
+};
 
-void Y (const char *s) {
-    char *c = _color (s, YELLOW);
-    _color_static (c);
-    free (c);
+struct f_pipeline {
+    struct pipeline_stage *stages;
+    int num;
+    int cap;
+    int head_fd;
+    int tail_fd;
+    bool started;
+    struct timespec start;
+};
+
+f_pipeline *f_pipeline_new () {
+    f_pipeline *p = f_mallocv (*p);
+    memset (p, 0, sizeof (*p));
+    p->head_fd = p->tail_fd = -1;
+    return p;
 }
 
-void BY (const char *s) {
-    char *c = _color (s, BRIGHT_YELLOW);
-    _color_static (c);
-    free (c);
+void f_pipeline_add (f_pipeline *p, char *const argv[]) {
+    if (p->started) {
+        iwarn ("Pipeline already started");
+        return;
+    }
+    if (p->num == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->stages = f_realloc (p->stages, p->cap * sizeof (*p->stages));
+    }
+    struct pipeline_stage *st = &p->stages[p->num++];
+    memset (st, 0, sizeof (*st));
+    int n = 0;
+    while (argv[n])
+        n++;
+    st->argv = f_malloc ((n + 1) * sizeof (char *));
+    for (int i = 0; i < n; i++)
+        st->argv[i] = f_strdup (argv[i]);
+    st->argv[n] = NULL;
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    st->cmd = f_strbuf_detach (&cmd);
 }
 
-void B (const char *s) {
-    char *c = _color (s, BLUE);
-    _color_static (c);
-    free (c);
+/* A stage didn't start: kill and reap the ones which did, and close our
+ * ends.
+ */
+static void _pipeline_abort (f_pipeline *p) {
+    if (p->head_fd != -1)
+        close (p->head_fd);
+    p->head_fd = -1;
+    for (int i = 0; i < p->num; i++) {
+        struct pipeline_stage *st = &p->stages[i];
+        if (!st->pid)
+            continue;
+        kill (st->pid, SIGKILL);
+        _sys_reap (st->pid, &p->start, false, NULL);
+        st->pid = 0;
+        st->status = -1;
+    }
 }
 
-void BB (const char *s) {
-    char *c = _color (s, BRIGHT_BLUE);
-    _color_static (c);
-    free (c);
+bool f_pipeline_start (f_pipeline *p, int flags) {
+    if (p->started || !p->num) {
+        iwarn (p->started ? "Pipeline already started" : "Empty pipeline");
+        return false;
+    }
+    p->started = true;
+    if (_verbose) {
+        f_strbuf all;
+        f_strbuf_init (&all);
+        for (int i = 0; i < p->num; i++) {
+            if (i)
+                f_strbuf_append (&all, " | ");
+            f_strbuf_append (&all, p->stages[i].cmd);
+        }
+        _sys_say (all.buf);
+        f_strbuf_free (&all);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &p->start);
+
+    // in: what the next stage reads from (-1: inherit).
+    int in = -1;
+    int fds[2];
+    if (flags & F_WRITE) {
+        if (pipe2 (fds, O_CLOEXEC)) {
+            _sys_launch_failed (p->stages[0].cmd, "writing", errno);
+            return false;
+        }
+        in = fds[0];
+        p->head_fd = fds[1];
+    }
+    for (int i = 0; i < p->num; i++) {
+        struct pipeline_stage *st = &p->stages[i];
+        bool last = i == p->num - 1;
+        int out = -1, next_in = -1;
+        if (!last || flags & F_READ) {
+            if (pipe2 (fds, O_CLOEXEC)) {
+                _sys_launch_failed (st->cmd, "reading", errno);
+                if (in != -1)
+                    close (in);
+                st->status = -1;
+                _pipeline_abort (p);
+                return false;
+            }
+            out = fds[1];
+            next_in = fds[0];
+        }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init (&fa);
+        if (in != -1)
+            posix_spawn_file_actions_adddup2 (&fa, in, STDIN_FILENO);
+        if (out != -1)
+            posix_spawn_file_actions_adddup2 (&fa, out, STDOUT_FILENO);
+        int rc = _spawn (&st->pid, st->argv, &fa);
+        posix_spawn_file_actions_destroy (&fa);
+        // the data goes from stage to stage, not through us.
+        if (in != -1)
+            close (in);
+        if (out != -1)
+            close (out);
+        if (rc) {
+            st->pid = 0;
+            st->status = -1;
+            if (next_in != -1)
+                close (next_in);
+            _sys_launch_failed (st->cmd, "reading", rc);
+            _pipeline_abort (p);
+            return false;
+        }
+        in = next_in;
+    }
+    if (flags & F_READ)
+        p->tail_fd = in;
+    return true;
 }
 
-void CY (const char *s) {
-    char *c = _color (s, CYAN);
-    _color_static (c);
-    free (c);
+int f_pipeline_head (f_pipeline *p) {
+    return p->head_fd;
 }
 
-void BCY (const char *s) {
-    char *c = _color (s, BRIGHT_CYAN);
-    _color_static (c);
-    free (c);
+int f_pipeline_tail (f_pipeline *p) {
+    return p->tail_fd;
 }
 
-void M (const char *s) {
-    char *c = _color (s, MAGENTA);
-    _color_static (c);
-    free (c);
+void f_pipeline_close_head (f_pipeline *p) {
+    if (p->head_fd != -1)
+        close (p->head_fd);
+    p->head_fd = -1;
 }
 
-void BM (const char *s) {
-    char *c = _color (s, BRIGHT_MAGENTA);
-    _color_static (c);
-    free (c);
+void f_pipeline_close_tail (f_pipeline *p) {
+    if (p->tail_fd != -1)
+        close (p->tail_fd);
+    p->tail_fd = -1;
 }
 
-/* Returns either a static pointer to a string (don't free it), in which
- * case buf is unused, or a pointer to the string stored in buf. In the
- * second case, does it need to be freed? XX
+/* Past the timeout: SIGTERM every stage still running, and SIGKILL what's
+ * left after one grace period for all of them.
  */
-
-const char *perr () {
-    char *st = str (100);
-    char *ret = strerror_r (errno, st, 100);
-    if (*st == '\0') {
-        // buffer unused
-        free (st);
-        return ret;
+static void _pipeline_timeout (f_pipeline *p) {
+    if (_sys_left_ms (&p->start) == -1)
+        return;
+    bool any = false;
+    for (int i = 0; i < p->num; i++) {
+        struct pipeline_stage *st = &p->stages[i];
+        if (!st->pid || _sys_wait_exit (st->pid, _sys_left_ms (&p->start)))
+            continue;
+        kill (st->pid, SIGTERM);
+        st->timed_out = any = true;
     }
-    else {
-        iwarn ("fixme: perr stored string in buf, possible leak.");
-        free (st);
-        return ret;
+    if (!any)
+        return;
+    for (int i = 0; i < p->num; i++) {
+        struct pipeline_stage *st = &p->stages[i];
+        if (!st->timed_out)
+            continue;
+        long grace_left = _sys_timeout_ms + _sys_grace_ms - (long) (_elapsed (&p->start) * 1000);
+        if (!_sys_wait_exit (st->pid, grace_left > 0 ? grace_left : 0))
+            kill (st->pid, SIGKILL);
     }
 }
 
-char *add_nl (const char *orig) {
-    // not including null
-    int len = strlen (orig);
-    char *new = f_malloc (sizeof (char) * (len + 2));
-    memset (new, '\0', len + 2);
-    // no null
-    strncpy (new, orig, len);
-    // adds null
-    strcat (new, "\n");
-    return new;
+int f_pipeline_wait (f_pipeline *p, int flags) {
+    f_pipeline_close_head (p);
+    f_pipeline_close_tail (p);
+    _pipeline_timeout (p);
+    int ret = 0;
+    for (int i = 0; i < p->num; i++) {
+        struct pipeline_stage *st = &p->stages[i];
+        if (!st->pid) {
+            if (st->status)
+                ret = st->status;
+            continue;
+        }
+        int status = _sys_reap (st->pid, &p->start, st->timed_out, NULL);
+        st->pid = 0;
+        if (st->timed_out)
+            st->status = _sys_timed_out (st->cmd, flags);
+        else {
+            st->status = _sys_status (status, st->cmd, flags);
+            // _sys_status gives 0 for a signal.
+            if (!st->status && status != -1 && WIFSIGNALED (status))
+                st->status = 128 + WTERMSIG (status);
+        }
+        if (st->status)
+            ret = st->status;
+    }
+    return ret;
 }
 
-void say (const char *format, ...) {
-    char *new = add_nl (format);
-    va_list arglist;
-    va_start ( arglist, format );
-    vprintf ( new, arglist );
-    va_end ( arglist );
-    free (new);
+int f_pipeline_num (f_pipeline *p) {
+    return p->num;
 }
 
-void ask (const char *format, ...) {
-    char *new = str (INFO_LENGTH);
-    char *new2 = str (INFO_LENGTH + 1);
-    va_list arglist, arglist_copy;
-    va_start ( arglist, format );
-    va_copy (arglist_copy, arglist);
-    // get rid of new2, just check rc XX
-    vsnprintf ( new, INFO_LENGTH, format, arglist );
-    vsnprintf ( new2, INFO_LENGTH + 1, format, arglist_copy );
-    if (strncmp (new, new2, INFO_LENGTH)) { // no + 1 necessary
-        warn ("Ask string truncated.");
+int f_pipeline_status (f_pipeline *p, int i) {
+    if (i < 0 || i >= p->num) {
+        iwarn ("No stage %d", i);
+        return -1;
     }
-    va_end ( arglist );
+    return p->stages[i].status;
+}
+
+void f_pipeline_destroy (f_pipeline *p) {
+    f_pipeline_close_head (p);
+    f_pipeline_close_tail (p);
+    bool running = false;
+    for (int i = 0; i < p->num; i++)
+        if (p->stages[i].pid)
+            running = true;
+    if (running)
+        f_pipeline_wait (p, F_QUIET);
+    for (int i = 0; i < p->num; i++) {
+        for (char **a = p->stages[i].argv; *a; a++)
+            f_free (*a);
+        f_free (p->stages[i].argv);
+        f_free (p->stages[i].cmd);
+    }
+    f_free (p->stages);
+    f_free (p);
+}
 
-    char *bullet = get_bullet ();
-    char *question = str (strlen (new) + COLOR_LENGTH + COLOR_LENGTH_RESET + strlen (bullet) + 1 + 1 + 1 + 1);
-    char *c = M_ (bullet);
-    sprintf (question, "%s %s? ", c, new);
-    printf (question);
-    free (c);
-    free (question);
+/* Job runner.
+ */
+struct job_run {
+    char **argv; // owned
+    int out_fd;
+    int pid_fd; // -1: no pidfd, poll with waitpid
+    bool eof;
+    bool exited;
+    bool timed_out;
+    // f_sys_timeout: 1 after SIGTERM, 2 after SIGKILL.
+    int kill_stage;
+    struct timespec start;
+};
+
+struct f_jobs {
+    int max;
+    int num;
+    int cap;
+    // pointers: f_strbuf can't move.
+    struct f_job **jobs;
+    struct job_run *runs;
+};
 
-    free (new);
-    free (new2);
+f_jobs *f_jobs_new (int max) {
+    f_jobs *jobs = f_mallocv (*jobs);
+    memset (jobs, 0, sizeof (*jobs));
+    if (max <= 0)
+        max = sysconf (_SC_NPROCESSORS_ONLN);
+    jobs->max = max > 0 ? max : 1;
+    return jobs;
 }
 
-void info (const char *format, ...) {
-    char *new = str (INFO_LENGTH);
-    char *new2 = str (INFO_LENGTH + 1);
-    va_list arglist;
-    va_list arglist_copy;
-    va_start ( arglist, format );
-    va_copy (arglist_copy, arglist);
-    // get rid of new2, just check rc XX
-    vsnprintf ( new, INFO_LENGTH, format, arglist );
-    vsnprintf ( new2, INFO_LENGTH + 1, format, arglist_copy );
-    if (strncmp (new, new2, INFO_LENGTH)) { // no + 1 necessary
-        warn ("Info string truncated.");
+static int _jobs_add (f_jobs *jobs, char **argv, const char *cmd) {
+    if (jobs->num == jobs->cap) {
+        jobs->cap = jobs->cap ? jobs->cap * 2 : 16;
+        jobs->jobs = f_realloc (jobs->jobs, jobs->cap * sizeof (*jobs->jobs));
+        jobs->runs = f_realloc (jobs->runs, jobs->cap * sizeof (*jobs->runs));
     }
-    va_end ( arglist );
+    struct f_job *job = f_mallocv (*job);
+    memset (job, 0, sizeof (*job));
+    job->cmd = f_strdup (cmd);
+    job->status = -1;
+    f_strbuf_init (&job->out);
+    struct job_run *run = &jobs->runs[jobs->num];
+    memset (run, 0, sizeof (*run));
+    run->argv = argv;
+    run->out_fd = run->pid_fd = -1;
+    jobs->jobs[jobs->num] = job;
+    return jobs->num++;
+}
 
-    char *bullet = get_bullet ();
-    char *infos = str (strlen (new) + COLOR_LENGTH + COLOR_LENGTH_RESET + strlen (bullet) + 1 + 1 + 1);
-    char *c = BB_ (bullet);
-    sprintf (infos, "%s %s\n", c, new);
-    printf (infos);
-    free (c);
-    free (infos);
+int f_jobs_add (f_jobs *jobs, const char *cmd) {
+    char **argv = f_malloc (4 * sizeof (char *));
+    argv[0] = f_strdup ("/bin/sh");
+    argv[1] = f_strdup ("-c");
+    argv[2] = f_strdup (cmd);
+    argv[3] = NULL;
+    return _jobs_add (jobs, argv, cmd);
+}
 
-    free (new);
-    free (new2);
+int f_jobs_addv (f_jobs *jobs, char *const argv[]) {
+    int n = 0;
+    while (argv[n])
+        n++;
+    char **copy = f_malloc ((n + 1) * sizeof (char *));
+    for (int i = 0; i < n; i++)
+        copy[i] = f_strdup (argv[i]);
+    copy[n] = NULL;
+    f_strbuf cmd;
+    f_strbuf_init (&cmd);
+    _argv_join (&cmd, argv);
+    int ret = _jobs_add (jobs, copy, cmd.buf);
+    f_strbuf_free (&cmd);
+    return ret;
 }
 
-void _err () {
-    fish_util_cleanup ();
-    exit (1);
+int f_jobs_num (f_jobs *jobs) {
+    return jobs->num;
 }
 
-void f_sys_die (bool b) {
-    _die = b;
+struct f_job *f_jobs_get (f_jobs *jobs, int i) {
+    if (i < 0 || i >= jobs->num) {
+        iwarn ("No job %d", i);
+        return NULL;
+    }
+    return jobs->jobs[i];
 }
 
-void f_verbose_cmds (bool b) {
-    _verbose = b;
+void f_jobs_destroy (f_jobs *jobs) {
+    for (int i = 0; i < jobs->num; i++) {
+        for (char **a = jobs->runs[i].argv; *a; a++)
+            f_free (*a);
+        f_free (jobs->runs[i].argv);
+        f_free (jobs->jobs[i]->cmd);
+        f_strbuf_free (&jobs->jobs[i]->out);
+        f_free (jobs->jobs[i]);
+    }
+    f_free (jobs->jobs);
+    f_free (jobs->runs);
+    f_free (jobs);
 }
 
-/* Non-null FILE means fork or pipe succeeded, but command could still fail
- * (e.g. command not found).
- * Caller should check for NULL, and if non-null, call sysclose to finish
- * (not free ()).
- */
-FILE *sysr (const char *cmd) {
-    if (_verbose) _sys_say (cmd);
-    FILE *f = popen (cmd, "r");
-    errno = -1;
-    if (!f) {
-        /* memory allocation failed (errno doesn't get set).
-         */
-        if (errno == -1)
-            oom_fatal ();
-        int e = errno;
-        _ ();
-        BR (cmd);
-        spr ("Can't launch cmd (%s) for reading, fork or pipe failed.", _s);
-        errno = e;
-        if (_die)
-            err_perr (_t);
-        else
-            warn_perr (_t);
+static bool _job_start (struct f_job *job, struct job_run *run, int flags) {
+    if (_verbose) _sys_say (job->cmd);
+    int fds[2];
+    if (pipe2 (fds, O_CLOEXEC)) {
+        _sys_launch_failed (job->cmd, "reading", errno);
+        return false;
     }
-    return f;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_adddup2 (&fa, fds[1], STDOUT_FILENO);
+    if (flags & F_STDERR)
+        posix_spawn_file_actions_adddup2 (&fa, fds[1], STDERR_FILENO);
+    clock_gettime (CLOCK_MONOTONIC, &run->start);
+    int rc = _spawn (&job->pid, run->argv, &fa);
+    posix_spawn_file_actions_destroy (&fa);
+    close (fds[1]);
+    if (rc) {
+        close (fds[0]);
+        _sys_launch_failed (job->cmd, "reading", rc);
+        return false;
+    }
+    run->out_fd = fds[0];
+    // no pidfd (old kernel): we'll poll with waitpid.
+    run->pid_fd = _pidfd_open (job->pid);
+    return true;
 }
 
-/* Non-null FILE means fork or pipe succeeded, but command could still fail
- * (e.g. command not found).
- * Caller should check for NULL, and if non-null, call sysclose to finish
- * (not free ()).
+static void _job_reap (struct f_job *job, struct job_run *run, bool block) {
+    if (!block) {
+        siginfo_t info = { 0 };
+        if (waitid (P_PID, job->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1) {
+            // ECHILD: someone else reaped it, don't wait4 for it.
+            if (errno != ECHILD)
+                return;
+            job->wait_status = -1;
+            run->exited = true;
+            return;
+        }
+        if (!info.si_pid)
+            return;
+    }
+    job->wait_status = _sys_reap (job->pid, &run->start, run->timed_out, &job->usage);
+    run->exited = true;
+    if (run->pid_fd != -1) {
+        close (run->pid_fd);
+        run->pid_fd = -1;
+    }
+}
+
+/* f_jobs_run is giving up: kill and reap it and close its fds.
  */
-FILE *sysw (const char *cmd) {
-    if (_verbose) _sys_say (cmd);
-    errno = -1;
-    FILE *f = popen (cmd, "w");
-    if (f == NULL) {
-        /* memory allocation failed (errno doesn't get set).
-         */
-        if (errno == -1)
-            oom_fatal ();
-        int e = errno;
-        _ ();
-        BR (cmd);
-        spr ("Can't launch cmd (%s) for reading, fork or pipe failed.", _s);
-        errno = e;
-        if (_die)
-            err_perr (_t);
-        else
-            warn_perr (_t);
+static void _job_abort (struct f_job *job, struct job_run *run) {
+    if (run->out_fd != -1) {
+        close (run->out_fd);
+        run->out_fd = -1;
     }
-    return f;
+    run->eof = true;
+    if (!run->exited) {
+        kill (job->pid, SIGKILL);
+        _job_reap (job, run, true);
+    }
+    job->status = -1;
 }
 
-/* 0 means good, -1 means wait or another sys call failed, > 0 is a non-zero
- * exit from the command.
- * The cmd arg is optional -- with it we can make a nicer error message.
- *
- * This will print an error message if a popen'ed command is closed while
- * there's still data in the buffer. Use flag F_QUIET to silence this.
+/* Past the timeout: SIGTERM, then SIGKILL after the grace period. Stops
+ * reading its output. Returns ms until it needs looking at again.
  */
-int sysclose_f (FILE *f, const char *cmd, int flags) {
-    bool quiet = flags && F_QUIET;
-    int status = pclose (f);
-    if (status) {
-        int en = errno;
-        _ ();
-        if (cmd && *cmd != '\0') {
-            BR (cmd);
-            spr (" «%s»", _s);
-        }
-        else {
-            spr ("");
-            spr ("");
-        }
-        /* On linux and most unices, the 7 least significant bits contain
-         * the signal, and the 8th tells us if we core dumped, if it was
-         * killed by a signal.
-         * We will assume we are on one of those systems.
-         */
-        int signal = status & 0x7F;
-        int core_dumped = status & 0x80;
-        if (signal) {
-            char *name;
-            f_signame (signal, &name, NULL);
-            CY (name);
-            spr (" «got signal %s»", _u);
+static long _job_timeout (struct f_job *job, struct job_run *run) {
+    long left = _sys_left_ms (&run->start);
+    if (left == -1 || run->exited || run->kill_stage == 2)
+        return -1;
+    if (!run->kill_stage) {
+        if (left)
+            return left;
+        kill (job->pid, SIGTERM);
+        run->kill_stage = 1;
+        run->timed_out = true;
+        if (run->out_fd != -1) {
+            close (run->out_fd);
+            run->out_fd = -1;
+            run->eof = true;
         }
-        else {
-            spr ("");
-            spr ("");
+    }
+    long grace_left = _sys_timeout_ms + _sys_grace_ms - (long) (_elapsed (&run->start) * 1000);
+    if (grace_left > 0)
+        return grace_left;
+    kill (job->pid, SIGKILL);
+    run->kill_stage = 2;
+    return -1;
+}
+
+static void _job_finish (struct f_job *job, struct job_run *run, int flags) {
+    job->wall = job->usage.wall;
+    if (run->timed_out) {
+        job->status = _sys_timed_out (job->cmd, flags);
+        return;
+    }
+    int st = job->wait_status;
+    if (st != -1 && WIFSIGNALED (st)) {
+        job->signal = WTERMSIG (st);
+        job->core_dumped = WCOREDUMP (st);
+        f_signame (job->signal, &job->signame, NULL);
+    }
+    job->status = _sys_status (st, job->cmd, flags);
+}
+
+int f_jobs_run (f_jobs *jobs, int flags) {
+    int max = jobs->max;
+    int next = 0, running = 0, failed = 0;
+    int *active = f_malloc (max * sizeof (int));
+    struct pollfd *pfd = f_malloc (2 * max * sizeof (*pfd));
+    int *which = f_malloc (2 * max * sizeof (int));
+
+    // jobs can be run again.
+    for (int i = 0; i < jobs->num; i++) {
+        struct job_run *run = &jobs->runs[i];
+        run->out_fd = run->pid_fd = -1;
+        run->eof = run->exited = run->timed_out = false;
+        run->kill_stage = 0;
+        struct f_job *job = jobs->jobs[i];
+        job->status = -1;
+        job->wait_status = 0;
+        job->signal = 0;
+        job->signame = NULL;
+        job->core_dumped = false;
+        f_strbuf_truncate (&job->out, 0);
+    }
+
+    while (next < jobs->num || running) {
+        while (running < max && next < jobs->num) {
+            int i = next++;
+            if (_job_start (jobs->jobs[i], &jobs->runs[i], flags))
+                active[running++] = i;
+            else
+                failed++;
         }
-        if (core_dumped) {
-            M ("core dumped");
-            spr (" «%s»", _w);
+
+        // output pipes and pidfds; jobs without a pidfd get checked every
+        // 50 ms.
+        int n = 0;
+        bool need_wait = false;
+        long timeout = -1;
+        for (int k = 0; k < running; k++) {
+            struct job_run *run = &jobs->runs[active[k]];
+            long t = _job_timeout (jobs->jobs[active[k]], run);
+            if (t != -1 && (timeout == -1 || t < timeout))
+                timeout = t;
+            if (run->out_fd != -1) {
+                pfd[n] = (struct pollfd) { .fd = run->out_fd, .events = POLLIN };
+                which[n++] = active[k];
+            }
+            if (run->pid_fd != -1) {
+                pfd[n] = (struct pollfd) { .fd = run->pid_fd, .events = POLLIN };
+                which[n++] = active[k];
+            }
+            else if (!run->exited)
+                need_wait = true;
         }
-        else {
-            spr ("");
-            spr ("");
+        if (need_wait && (timeout == -1 || timeout > 50))
+            timeout = 50;
+        if (poll (pfd, n, timeout) == -1 && errno != EINTR) {
+            warn_perr ("Couldn't poll jobs");
+            for (int k = 0; k < running; k++)
+                _job_abort (jobs->jobs[active[k]], &jobs->runs[active[k]]);
+            failed += running + jobs->num - next;
+            break;
         }
 
-        status >>= 8;
-        spr ("%d", status);
-        Y (_y);
-        // XX
-        char *msg = spr_ ("Error closing cmd%s «exit status %s»%s%s.", 300, _t, _z, _v, _x);
-        if (status == -1) {
-            errno = en;
-            if (_die)
-                err_perr (msg);
-            else if (!quiet)
-                warn_perr (msg);
+        for (int k = 0; k < n; k++) {
+            if (!pfd[k].revents)
+                continue;
+            struct f_job *job = jobs->jobs[which[k]];
+            struct job_run *run = &jobs->runs[which[k]];
+            if (pfd[k].fd == run->out_fd) {
+                if (_capture_read (run->out_fd, &job->out, 0, 65536) <= 0) {
+                    close (run->out_fd);
+                    run->out_fd = -1;
+                    run->eof = true;
+                }
+            }
+            else
+                _job_reap (job, run, true);
         }
-        else {
-            if (_die)
-                err (msg);
-            else if (!quiet)
-                warn (msg);
+
+        for (int k = 0; k < running; ) {
+            struct f_job *job = jobs->jobs[active[k]];
+            struct job_run *run = &jobs->runs[active[k]];
+            if (!run->exited && run->pid_fd == -1)
+                _job_reap (job, run, false);
+            if (!run->eof || !run->exited) {
+                k++;
+                continue;
+            }
+            _job_finish (job, run, flags);
+            // status is 0 for a signal, as with sysclose_f.
+            if (job->status || job->signal)
+                failed++;
+            active[k] = active[--running];
         }
-        free (msg);
     }
-    return status;
-}
-
-int sysclose (FILE *f) {
-    return sysclose_f (f, NULL, 0);
+    f_free (active);
+    f_free (pfd);
+    f_free (which);
+    return failed;
 }
 
 /* Run command and read input until EOF.
@@ -907,30 +5094,48 @@ int sysclose (FILE *f) {
  * To not read the input, use sysr.
  */
 int sys (const char *cmd) {
+    if (_coproc_on)
+        return _coproc_sys (cmd, NULL, 0, 0);
     FILE *f = sysr (cmd);
     /* Leave complaining to sysr.
      */
     if (!f)
         return -1;
 
-    int rc;
-    char buf[100];
-    errno = -1;
-    while (fgets (buf, 100, f)) {
-    }
-    if (ferror (f)) {
-        /* Not clear whether fgets is required to set errno.
-         */
-        if (errno != -1)
-            warn_perr ("Interrupted read from command");
-        else
-            warn ("Interrupted read from command");
+    if (!_sys_drain (f)) {
+        sysclose_f (f, cmd, F_QUIET);
         return -1;
     }
 
     return sysclose_f (f, cmd, 0);
 }
 
+/* Read and throw away the output of a sysr / sysv_r command until EOF, or
+ * until it times out (sysclose then does the killing).
+ */
+static bool _sys_drain (FILE *f) {
+    struct timespec start;
+    _sys_child_find (f, &start);
+    char buf[4096];
+    int fd = fileno (f);
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int rc = poll (&pfd, 1, _sys_left_ms (&start));
+        if (!rc)
+            return true;
+        ssize_t n = rc == -1 ? -1 : read (fd, buf, sizeof (buf));
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            warn_perr ("Interrupted read from command");
+            return false;
+        }
+        return true;
+    }
+}
+
 bool f_sig (int signum, void *func) {
     /* Ok that it's thrown away.
      */
@@ -1047,16 +5252,31 @@ bool f_socket_make_named (const char *filename, int *socknum) {
    */
     size = (offsetof (struct sockaddr_un, sun_path) + strlen (name.sun_path) + 1);
 
-    if (bind (sock, (struct sockaddr *) &name, size) < 0) {
+    if (bind (sock, (struct sockaddr *) &name, size) < 0) {
+        int en = errno;
+        _ ();
+        Y (filename);
+        errno = en;
+        warn ("Can't bind socket %s (%s)", _s, perr ());
+        return false;
+    }
+
+    *socknum = sock;
+    return true;
+}
+
+/* backlog <= 0: SOMAXCONN.
+ */
+bool f_socket_listen (int socket, int backlog) {
+    if (listen (socket, backlog > 0 ? backlog : SOMAXCONN)) {
         int en = errno;
         _ ();
-        Y (filename);
+        spr ("%d", socket);
+        Y (_s);
         errno = en;
-        warn ("Can't bind socket %s (%s)", _s, perr ());
+        warn ("Can't listen on socket %s (%s)", _t, perr ());
         return false;
     }
-
-    *socknum = sock;
     return true;
 }
 
@@ -1081,8 +5301,12 @@ bool f_socket_make_client (int socket, int *client_socket) {
 }
 
 bool f_socket_read (int client_socket, ssize_t *num_read, char *buf, size_t max_length) {
-    ssize_t rc = recv (client_socket, buf, max_length, 0); // blocking
+    // blocks, unless the socket is non-blocking.
+    ssize_t rc = recv (client_socket, buf, max_length, 0);
     if (rc == -1) {
+        // nothing wrong, or nothing we need to hear about.
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNRESET)
+            return false;
         int en = errno;
         _ ();
         spr ("%d", client_socket);
@@ -1097,8 +5321,13 @@ bool f_socket_read (int client_socket, ssize_t *num_read, char *buf, size_t max_
 }
 
 bool f_socket_write (int client_socket, ssize_t *num_written, const char *buf, size_t len) {
-    ssize_t rc = write (client_socket, buf, len);
+    // no SIGPIPE if the other end is gone: EPIPE instead.
+    ssize_t rc = send (client_socket, buf, len, MSG_NOSIGNAL);
+    if (rc == -1 && errno == ENOTSOCK)
+        rc = write (client_socket, buf, len);
     if (rc == -1) {
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNRESET || errno == EPIPE)
+            return false;
         int en = errno;
         _ ();
         spr ("%d", client_socket);
@@ -1142,11 +5371,12 @@ bool f_socket_unix_message_f (const char *filename, const char *msg, char *respo
     int msg_len = strlen (msg); // -O- trust caller
     int filename_len = strlen (filename); // -O- trust caller
 
-    // both leak on early return XX
+    // leaks on early return XX
     char *filename_color = CY_ (filename);
-    char *msg_s = str (msg_len + 1 + 1);
-
-    sprintf (msg_s, "%s\n", msg);
+    f_strbuf msg_s;
+    f_strbuf_init (&msg_s);
+    f_strbuf_append_n (&msg_s, msg, msg_len);
+    f_strbuf_append_c (&msg_s, '\n');
 
     if (strlen (msg) >= buf_length) {
         _ ();
@@ -1173,7 +5403,7 @@ bool f_socket_unix_message_f (const char *filename, const char *msg, char *respo
         return false;
     }
 
-    int rc = write (sockfd, msg_s, msg_len + 1);
+    int rc = write (sockfd, msg_s.buf, msg_s.len);
 
     if (rc < 0) {
         iwarn_perr ("Error writing to socket %s", filename_color);
@@ -1204,8 +5434,8 @@ bool f_socket_unix_message_f (const char *filename, const char *msg, char *respo
         return false;
     }
 
-    free (filename_color);
-    free (msg_s);
+    f_free (filename_color);
+    f_strbuf_free (&msg_s);
 
     return true;
 }
@@ -1215,9 +5445,558 @@ bool f_socket_unix_message (const char *filename, const char *msg) {
     return f_socket_unix_message_f (filename, msg, NULL, SOCKET_LENGTH_DEFAULT);
 }
 
+/* Event loop: epoll, edge-triggered, so every ready fd is read / written
+ * until EAGAIN.
+ * Connections which get closed while events are being handled are only
+ * marked dead and freed after the batch, since a later event in the same
+ * batch can still point at them.
+ */
+#define LOOP_EVENTS 64
+#define LOOP_READ_CHUNK 16384
+// unconsumed input past this closes the connection.
+#define LOOP_IN_MAX (16 * 1024 * 1024)
+// ms between accept retries when we're out of fds.
+#define LOOP_ACCEPT_RETRY 100
+
+struct f_conn {
+    f_loop *loop;
+    int fd;
+    bool listener;
+    bool retrying; // listener: accept retry timer pending
+    bool closing; // close once out is written
+    bool dead;
+    bool eof;
+    struct f_conn_callbacks cb;
+    void *data;
+    f_strbuf in;
+    f_strbuf out;
+    size_t out_pos;
+    struct f_conn *prev, *next;
+    struct f_conn *next_dead;
+};
+
+struct loop_timer {
+    long long due; // ms, CLOCK_MONOTONIC
+    long interval; // 0: once
+    int id;
+    bool cancelled;
+    f_timer_func func;
+    void *data;
+};
+
+struct f_loop {
+    int epfd;
+    bool stop;
+    int num_conns; // not counting listeners
+    struct f_conn *conns;
+    struct f_conn *dead;
+    // min-heap on due.
+    struct loop_timer **timers;
+    int timers_num;
+    int timers_cap;
+    int timer_id;
+    struct loop_timer *firing;
+    // spare fd, given up at EMFILE to accept and drop connections.
+    int reserve_fd;
+};
+
+static long long _loop_now () {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+f_loop *f_loop_new () {
+    int epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        warn_perr ("Can't make epoll instance");
+        return NULL;
+    }
+    f_loop *loop = f_mallocv (*loop);
+    memset (loop, 0, sizeof (*loop));
+    loop->epfd = epfd;
+    loop->reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    return loop;
+}
+
+static f_conn *_loop_add (f_loop *loop, int fd, bool listener, const struct f_conn_callbacks *cb, void *data) {
+    f_conn *c = f_mallocv (*c);
+    memset (c, 0, sizeof (*c));
+    c->loop = loop;
+    c->fd = fd;
+    c->listener = listener;
+    if (cb)
+        c->cb = *cb;
+    c->data = data;
+    f_strbuf_init (&c->in);
+    f_strbuf_init (&c->out);
+    struct epoll_event ev = {
+        .events = listener ? EPOLLIN | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = c,
+    };
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        int en = errno;
+        _ ();
+        spr ("%d", fd);
+        Y (_s);
+        errno = en;
+        warn ("Can't add fd %s to the event loop (%s)", _t, perr ());
+        f_strbuf_free (&c->in);
+        f_strbuf_free (&c->out);
+        f_free (c);
+        return NULL;
+    }
+    c->next = loop->conns;
+    if (loop->conns)
+        loop->conns->prev = c;
+    loop->conns = c;
+    if (!listener)
+        loop->num_conns++;
+    return c;
+}
+
+bool f_loop_listen (f_loop *loop, int socket, const struct f_conn_callbacks *cb, void *data) {
+    return _loop_add (loop, socket, true, cb, data) != NULL;
+}
+
+f_conn *f_loop_add_fd (f_loop *loop, int fd, const struct f_conn_callbacks *cb, void *data) {
+    int fl = fcntl (fd, F_GETFL);
+    if (fl != -1 && ! (fl & O_NONBLOCK))
+        fcntl (fd, F_SETFL, fl | O_NONBLOCK);
+    f_conn *c = _loop_add (loop, fd, false, cb, data);
+    if (c && c->cb.accept)
+        c->cb.accept (c);
+    return c;
+}
+
+/* Off the list and out of epoll now; freed after the batch.
+ */
+static void _conn_kill (f_conn *c) {
+    if (c->dead)
+        return;
+    f_loop *loop = c->loop;
+    c->dead = true;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        loop->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    if (!c->listener)
+        loop->num_conns--;
+    // closing removes it from epoll.
+    f_socket_close (c->fd);
+    if (c->cb.closed)
+        c->cb.closed (c);
+    c->next_dead = loop->dead;
+    loop->dead = c;
+}
+
+static void _loop_reap (f_loop *loop) {
+    while (loop->dead) {
+        f_conn *c = loop->dead;
+        loop->dead = c->next_dead;
+        f_strbuf_free (&c->in);
+        f_strbuf_free (&c->out);
+        f_free (c);
+    }
+}
+
+/* Write as much of out as the socket takes. false if the conn died.
+ */
+static bool _conn_flush (f_conn *c) {
+    while (c->out_pos < c->out.len) {
+        ssize_t n;
+        if (!f_socket_write (c->fd, &n, c->out.buf + c->out_pos, c->out.len - c->out_pos)) {
+            if (errno == EAGAIN)
+                return true;
+            if (errno == EINTR)
+                continue;
+            _conn_kill (c);
+            return false;
+        }
+        c->out_pos += n;
+    }
+    f_strbuf_truncate (&c->out, 0);
+    c->out_pos = 0;
+    if (c->closing) {
+        _conn_kill (c);
+        return false;
+    }
+    return true;
+}
+
+bool f_conn_write (f_conn *c, const char *buf, size_t len) {
+    if (c->dead || c->closing)
+        return false;
+    // nothing queued: try it straight away.
+    if (c->out_pos == c->out.len) {
+        while (len) {
+            ssize_t n;
+            if (!f_socket_write (c->fd, &n, buf, len)) {
+                if (errno == EAGAIN)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                _conn_kill (c);
+                return false;
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+    if (len)
+        f_strbuf_append_n (&c->out, buf, len);
+    return true;
+}
+
+void f_conn_close (f_conn *c) {
+    if (c->dead)
+        return;
+    c->closing = true;
+    if (c->out_pos == c->out.len)
+        _conn_kill (c);
+}
+
+f_strbuf *f_conn_in (f_conn *c) {
+    return &c->in;
+}
+
+void f_conn_consume (f_conn *c, size_t n) {
+    if (n >= c->in.len) {
+        f_strbuf_truncate (&c->in, 0);
+        return;
+    }
+    memmove (c->in.buf, c->in.buf + n, c->in.len - n);
+    f_strbuf_truncate (&c->in, c->in.len - n);
+}
+
+size_t f_conn_pending (f_conn *c) {
+    return c->out.len - c->out_pos;
+}
+
+int f_conn_fd (f_conn *c) {
+    return c->fd;
+}
+
+void *f_conn_data (f_conn *c) {
+    return c->data;
+}
+
+void f_conn_set_data (f_conn *c, void *data) {
+    c->data = data;
+}
+
+f_loop *f_conn_loop (f_conn *c) {
+    return c->loop;
+}
+
+static void _loop_accept (f_conn *l);
+
+static void _loop_accept_retry (void *data) {
+    f_conn *l = data;
+    l->retrying = false;
+    _loop_accept (l);
+}
+
+static void _loop_accept_later (f_conn *l) {
+    if (l->retrying)
+        return;
+    l->retrying = true;
+    f_loop_timer (l->loop, LOOP_ACCEPT_RETRY, false, _loop_accept_retry, l);
+}
+
+/* Out of fds, with connections waiting. Edge-triggered, so we won't hear
+ * about them again: free the reserve fd to accept one and drop it. Without
+ * a reserve, try again from a timer. false to stop accepting for now.
+ */
+static bool _loop_shed (f_conn *l, bool *warned) {
+    f_loop *loop = l->loop;
+    if (!*warned) {
+        _ ();
+        spr ("%d", l->fd);
+        Y (_s);
+        warn ("Out of fds: dropping connections on socket %s", _t);
+        *warned = true;
+    }
+    if (loop->reserve_fd == -1) {
+        _loop_accept_later (l);
+        return false;
+    }
+    close (loop->reserve_fd);
+    int cs = accept4 (l->fd, NULL, NULL, SOCK_CLOEXEC);
+    int en = errno;
+    if (cs != -1)
+        close (cs);
+    loop->reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (cs != -1 || en == EINTR || en == ECONNABORTED)
+        return true;
+    // still out: something else took the fd.
+    if (en != EAGAIN)
+        _loop_accept_later (l);
+    return false;
+}
+
+/* Take every waiting connection (one wakeup for all of them), until
+ * EAGAIN.
+ */
+static void _loop_accept (f_conn *l) {
+    bool warned = false;
+    while (!l->dead) {
+        int cs = accept4 (l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cs == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (_loop_shed (l, &warned))
+                    continue;
+                return;
+            }
+            if (errno != EAGAIN) {
+                int en = errno;
+                _ ();
+                spr ("%d", l->fd);
+                Y (_s);
+                errno = en;
+                warn ("Couldn't accept on socket %s (%s)", _t, perr ());
+            }
+            return;
+        }
+        f_conn *c = _loop_add (l->loop, cs, false, &l->cb, l->data);
+        if (!c) {
+            close (cs);
+            continue;
+        }
+        if (c->cb.accept)
+            c->cb.accept (c);
+    }
+}
+
+/* Read until EAGAIN (edge-triggered) or EOF, then tell the owner.
+ */
+static void _conn_read (f_conn *c) {
+    bool got = false;
+    while (!c->eof) {
+        if (c->in.len >= LOOP_IN_MAX) {
+            // the owner might take some now.
+            if (got && c->cb.readable) {
+                got = false;
+                c->cb.readable (c);
+                if (c->dead)
+                    return;
+            }
+            if (c->in.len >= LOOP_IN_MAX) {
+                _ ();
+                spr ("%d", c->fd);
+                Y (_s);
+                warn ("Too much unread input on fd %s, closing", _t);
+                c->eof = true;
+                break;
+            }
+        }
+        f_strbuf_reserve (&c->in, LOOP_READ_CHUNK);
+        ssize_t n;
+        if (!f_socket_read (c->fd, &n, c->in.buf + c->in.len, LOOP_READ_CHUNK)) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                c->eof = true;
+            break;
+        }
+        if (!n) {
+            c->eof = true;
+            break;
+        }
+        c->in.len += n;
+        c->in.buf[c->in.len] = '\0';
+        got = true;
+    }
+    if (got && c->cb.readable)
+        c->cb.readable (c);
+    if (c->eof && !c->dead) {
+        // let pending output go first.
+        c->closing = true;
+        if (c->out_pos == c->out.len)
+            _conn_kill (c);
+    }
+}
+
+static void _conn_event (f_conn *c, uint32_t events) {
+    if (c->listener) {
+        _loop_accept (c);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        _conn_read (c);
+    if (c->dead)
+        return;
+    // EPOLLHUP: both ways, so nothing more can go out either.
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        _conn_kill (c);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        bool had = c->out_pos < c->out.len;
+        if (_conn_flush (c) && had && c->out_pos == c->out.len && c->cb.writable)
+            c->cb.writable (c);
+    }
+}
+
+static void _timer_swap (f_loop *loop, int i, int j) {
+    struct loop_timer *t = loop->timers[i];
+    loop->timers[i] = loop->timers[j];
+    loop->timers[j] = t;
+}
+
+static void _timer_push (f_loop *loop, struct loop_timer *t) {
+    if (loop->timers_num == loop->timers_cap) {
+        loop->timers_cap = loop->timers_cap ? loop->timers_cap * 2 : 8;
+        loop->timers = f_realloc (loop->timers, loop->timers_cap * sizeof (*loop->timers));
+    }
+    int i = loop->timers_num++;
+    loop->timers[i] = t;
+    while (i && loop->timers[(i - 1) / 2]->due > loop->timers[i]->due) {
+        _timer_swap (loop, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static struct loop_timer *_timer_pop (f_loop *loop) {
+    struct loop_timer *top = loop->timers[0];
+    loop->timers[0] = loop->timers[--loop->timers_num];
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < loop->timers_num && loop->timers[l]->due < loop->timers[min]->due)
+            min = l;
+        if (r < loop->timers_num && loop->timers[r]->due < loop->timers[min]->due)
+            min = r;
+        if (min == i)
+            break;
+        _timer_swap (loop, i, min);
+        i = min;
+    }
+    return top;
+}
+
+int f_loop_timer (f_loop *loop, long ms, bool repeat, f_timer_func func, void *data) {
+    struct loop_timer *t = f_mallocv (*t);
+    t->due = _loop_now () + ms;
+    t->interval = repeat ? (ms > 0 ? ms : 1) : 0;
+    t->id = ++loop->timer_id;
+    t->cancelled = false;
+    t->func = func;
+    t->data = data;
+    _timer_push (loop, t);
+    return t->id;
+}
+
+/* Marked, and dropped when it comes up.
+ */
+void f_loop_timer_cancel (f_loop *loop, int id) {
+    if (loop->firing && loop->firing->id == id) {
+        loop->firing->cancelled = true;
+        return;
+    }
+    for (int i = 0; i < loop->timers_num; i++) {
+        if (loop->timers[i]->id == id) {
+            loop->timers[i]->cancelled = true;
+            return;
+        }
+    }
+}
+
+/* Fire what's due; returns ms until the next one, -1 if there are none.
+ */
+static int _loop_timers (f_loop *loop) {
+    long long now = _loop_now ();
+    while (loop->timers_num && !loop->stop) {
+        struct loop_timer *t = loop->timers[0];
+        if (!t->cancelled && t->due > now) {
+            long long left = t->due - now;
+            return left > INT_MAX ? INT_MAX : left;
+        }
+        _timer_pop (loop);
+        if (!t->cancelled) {
+            loop->firing = t;
+            t->func (t->data);
+            loop->firing = NULL;
+        }
+        if (t->interval && !t->cancelled) {
+            // no catching up on missed ticks.
+            t->due += t->interval;
+            if (t->due <= now)
+                t->due = now + t->interval;
+            _timer_push (loop, t);
+        }
+        else
+            f_free (t);
+    }
+    return loop->stop ? 0 : -1;
+}
+
+/* Returns when f_loop_stop is called, or when there are no connections
+ * and no timers left (listeners alone keep it going). -1 if epoll_wait
+ * failed.
+ */
+int f_loop_run (f_loop *loop) {
+    struct epoll_event events[LOOP_EVENTS];
+    loop->stop = false;
+    while (!loop->stop) {
+        int timeout = _loop_timers (loop);
+        _loop_reap (loop);
+        if (loop->stop)
+            break;
+        if (timeout == -1 && !loop->conns)
+            break;
+        int n = epoll_wait (loop->epfd, events, LOOP_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            warn_perr ("Error waiting for events");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            f_conn *c = events[i].data.ptr;
+            if (!c->dead)
+                _conn_event (c, events[i].events);
+        }
+        _loop_reap (loop);
+    }
+    return 0;
+}
+
+void f_loop_stop (f_loop *loop) {
+    loop->stop = true;
+}
+
+int f_loop_num_conns (f_loop *loop) {
+    return loop->num_conns;
+}
+
+/* Closes everything still open (with closed callbacks, output which
+ * hasn't gone out is lost).
+ */
+void f_loop_destroy (f_loop *loop) {
+    while (loop->conns)
+        _conn_kill (loop->conns);
+    _loop_reap (loop);
+    for (int i = 0; i < loop->timers_num; i++)
+        f_free (loop->timers[i]);
+    f_free (loop->timers);
+    if (loop->reserve_fd != -1)
+        close (loop->reserve_fd);
+    close (loop->epfd);
+    f_free (loop);
+}
+
 double f_time_hires () {
+    return f_time_hires_f (0);
+}
+
+double f_time_hires_f (int flags) {
     struct timespec t;
-    clock_gettime (CLOCK_REALTIME, &t);
+    clock_gettime (flags & F_TIME_COARSE ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &t);
 
     time_t secs = t.tv_sec;
     long nano = t.tv_nsec;
@@ -1226,6 +6005,72 @@ double f_time_hires () {
     return c;
 }
 
+/* out must hold F_TIMESTAMP_LENGTH. The part up to the seconds only
+ * changes once a second, so it's kept per thread and copied; the fraction
+ * is written by hand.
+ */
+static int _timestamp_fmt (char *out, const struct timespec *t, int flags) {
+    int utc = flags & F_TIME_UTC;
+    if (t->tv_sec != _ts_sec || utc != _ts_utc) {
+        struct tm tm;
+        if (utc)
+            gmtime_r (&t->tv_sec, &tm);
+        else
+            localtime_r (&t->tv_sec, &tm);
+        _ts_len = strftime (_ts_prefix, sizeof (_ts_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+        _ts_sec = t->tv_sec;
+        _ts_utc = utc;
+    }
+    memcpy (out, _ts_prefix, _ts_len);
+    int len = _ts_len;
+    int digits = flags & F_TIME_US ? 6 : flags & F_TIME_MS ? 3 : 0;
+    if (digits) {
+        long frac = digits == 6 ? t->tv_nsec / 1000 : t->tv_nsec / 1000000;
+        out[len] = '.';
+        for (int i = digits; i > 0; i--) {
+            out[len + i] = '0' + frac % 10;
+            frac /= 10;
+        }
+        len += 1 + digits;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/* Like snprintf: returns the length it wanted.
+ */
+int f_timestamp (char *buf, size_t len, int flags) {
+    struct timespec t;
+    clock_gettime (flags & F_TIME_COARSE ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &t);
+    char ts[F_TIMESTAMP_LENGTH];
+    int n = _timestamp_fmt (ts, &t, flags);
+    if (len) {
+        size_t m = (size_t) n + 1 < len ? (size_t) n : len - 1;
+        memcpy (buf, ts, m);
+        buf[m] = '\0';
+    }
+    return n;
+}
+
+void f_log_timestamps (bool b) {
+    f_log_timestamps_f (b, F_TIME_MS);
+}
+
+void f_log_timestamps_f (bool b, int flags) {
+    _log_ts_flags = flags;
+    _log_ts = b;
+}
+
+/* Timestamp and a space, for the start of a message.
+ */
+static void _log_timestamp (f_strbuf *b) {
+    struct timespec t;
+    clock_gettime (_log_ts_flags & F_TIME_COARSE ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &t);
+    f_strbuf_reserve (b, F_TIMESTAMP_LENGTH + 1);
+    b->len += _timestamp_fmt (b->buf + b->len, &t, _log_ts_flags);
+    f_strbuf_append_c (b, ' ');
+}
+
 /* Uses deprecated function `ftime`.
  */
 double f_time_hires_old () {
@@ -1418,15 +6263,15 @@ char *f_comma (long n) {
         }
     }
     int bytes_written = k + 1; // not counting \0
-    free (n_as_str);
+    f_free (n_as_str);
     char *ret = f_reverse_str (ret_r, bytes_written);
-    free (ret_r);
-    free (str_r);
+    f_free (ret_r);
+    f_free (str_r);
     return ret;
 }
 
 int f_get_static_str_length () {
-    return STATIC_STR_LENGTH;
+    return _static_str_initted ? _static_str_len : _static_str_len_conf;
 }
 
 bool f_set_utf8_f (int flags) {
@@ -1467,7 +6312,7 @@ bool f_set_utf8_f (int flags) {
         char *locale = str (12);
 
         sprintf (locale, "%s.UTF-8", lang);
-        free (lang);
+        f_free (lang);
 
         char *m = setlocale (LC_ALL, locale);
         bool ok;
@@ -1481,7 +6326,7 @@ bool f_set_utf8_f (int flags) {
             if (verbose)
                 info ("Set locale to %s", locale);
         }
-        free (locale);
+        f_free (locale);
         return ok;
 
     }
@@ -1511,7 +6356,7 @@ wchar_t *d8 (char *s) {
     else {
         debug ("d8: converted %d chars", num);
     }
-    free (_line);
+    f_free (_line);
     return line8;
 }
 
@@ -1678,237 +6523,169 @@ void f_signame (int signal, char **name, char **desc) {
  * and not a macro to not pollute the caller's namespace.
  */
 void _complain (const char *file, unsigned int line, bool iserr, bool do_perr, const char *format, ...) {
+    va_list arglist;
+    va_start (arglist, format);
+    _vcomplain (file, line, NULL, iserr, do_perr, format, arglist);
+    va_end (arglist);
+}
+
+/* Same, with the prefix from the site.
+ */
+void _complain_site (struct f_site *site, bool iserr, bool do_perr, const char *format, ...) {
+    va_list arglist;
+    va_start (arglist, format);
+    _vcomplain (site->file, site->line, site, iserr, do_perr, format, arglist);
+    va_end (arglist);
+}
+
+static void _vcomplain (const char *file, unsigned int line, struct f_site *site, bool iserr, bool do_perr, const char *format, va_list arglist) {
 
     int en = errno;
+    if (_f_rate_burst)
+        _sites_sweep (_coarse_ms ());
+    bool internal = file && line;
+
+    if (_log_format != F_LOG_FORMAT_TEXT) {
+        char ebuf[100];
+        const char *errtext = do_perr ? strerror_r (en, ebuf, sizeof (ebuf)) : NULL;
+        _log_record (F_OUT_WARN, iserr ? F_LOG_ERR : F_LOG_WARN,
+            internal ? file : NULL, line, errtext, format, arglist);
+        errno = en;
+        return;
+    }
 
-    char *the_str = str (COMPLAINT_LENGTH);
+    f_strbuf b;
+    f_strbuf_init (&b);
+    if (_log_ts)
+        _log_timestamp (&b);
 
-    /* On overflow, snprintf is null-terminated, but rc is >= n.
-     */
-    va_list arglist;
-    va_start (arglist, format);
-    int rc;
-    rc = vsnprintf (the_str, COMPLAINT_LENGTH, format, arglist);
-    if (rc >= COMPLAINT_LENGTH) {
-        // careful, recursive
-        warn ("(message string truncated).");
+    f_strbuf_append_color (&b, get_bullet (), iserr ? F_COLOR_RED : F_COLOR_BRIGHT_RED);
+    f_strbuf_append_c (&b, ' ');
+
+    if (internal) {
+        if (site)
+            f_strbuf_append (&b, _site_prefix (site));
+        else
+            _warn_prefix_append (&b, file, line, _colors_on ());
+        f_strbuf_append_c (&b, ' ');
     }
-    va_end (arglist);
 
-    /* malloc
+    /* See comments in fish-util.h for all the cases.
+     * Write the lead-in for a message and then the message; if it turns
+     * out to be empty, back up and write the lead-in for no message.
      */
-    char *fl = NULL;
-    char *p = NULL; // perr
-    char *bull = get_bullet ();
-    char *bullet = iserr ? R_ (bull) : BR_ (bull);
-
-    char *t1 = "";
-    char *t2 = "";
-    char *t3 = "";
-    char *t4 = "";
-    char *t5 = "";
-    char *t6 = "";
-    char *t7 = "";
-
-    /* see comments in fish-util.h for all the cases.
-     */
-    if (file && line) {
-        fl = f_get_warn_prefix (file, line);
-        t1 = fl;
-        t2 = " ";
-        if (iserr) {
-            if (do_perr) {
-                errno = en;
-                p = BR_ ((char*) perr ()); // ditch const
-                // ierr_perr (msg)
-                if (*the_str) {
-                    t3 = "Internal error: ";
-                    t4 = the_str;
-                    t5 = " (";
-                    t6 = p;
-                    t7 = ").";
-                }
-                // ierr_perr ()
-                else {
-                    t3 = "Internal error (";
-                    t4 = p;
-                    t5 = ").";
-                }
-            }
-            else {
-                // ierr (msg)
-                if (*the_str) {
-                    t3 = "Internal error: ";
-                    t4 = the_str;
-                }
-                // ierr ()
-                else {
-                    t3 = "Internal error.";
-                }
-            }
-        }
-        else {
-            if (do_perr) {
-                errno = en;
-                p = BR_ ((char*) perr ()); // ditch const
-                // iwarn_perr (msg)
-                if (*the_str) {
-                    t3 = "Internal warning: ";
-                    t4 = the_str;
-                    t5 = " (";
-                    t6 = p;
-                    t7 = ").";
-                }
-                // iwarn_perr ()
-                else {
-                    t3 = "Something's wrong (internally) (";
-                    t2 = p;
-                    t3 = ").";
-                }
-            }
-            else {
-                // iwarn (msg)
-                if (*the_str) {
-                    t3 = "Internal warning: ";
-                    t4 = the_str;
-                }
-                // iwarn ()
-                else {
-                    t3 = "Something's wrong (internally).";
-                }
-            }
-        }
+    size_t start = b.len;
+    f_strbuf_append (&b,
+        internal ? (iserr ? "Internal error: " : "Internal warning: ") :
+        iserr ? "Error: " : ""
+    );
+    size_t msg_start = b.len;
+
+    f_strbuf_vappendf (&b, format, arglist);
+
+    if (b.len == msg_start) {
+        f_strbuf_truncate (&b, start);
+        f_strbuf_append (&b,
+            internal ? (iserr ? "Internal error" : "Something's wrong (internally)") :
+            iserr ? "Error" : "Something's wrong"
+        );
+        if (!do_perr)
+            f_strbuf_append_c (&b, '.');
     }
-    /* user/system warnings and errors
-     */
-    else {
-        if (iserr) {
-            if (do_perr) {
-                errno = en;
-                p = BR_ ((char*) perr ()); // ditch const
-                // err_perr (msg)
-                if (*the_str) {
-                    t1 = "Error: ";
-                    t2 = the_str;
-                    t3 = " (";
-                    t4 = p;
-                    t5 = ").";
-                }
-                // err_perr ()
-                else {
-                    t1 = "Error (";
-                    t2 = p;
-                    t3 = ").";
-                }
-            }
-            else {
-                // err (msg)
-                if (*the_str) {
-                    t1 = "Error: ";
-                    t2 = the_str;
-                }
-                // err ()
-                else {
-                    t1 = "Error.";
-                }
-            }
-        }
-        else {
-            if (do_perr) {
-                errno = en;
-                p = BR_ ((char*) perr ()); // ditch const
-                // warn_perr (msg)
-                if (*the_str) {
-                    t1 = the_str;
-                    t2 = " (";
-                    t3 = p;
-                    t4 = ").";
-                }
-                // warn_perr ()
-                else {
-                    t1 = "Something's wrong (";
-                    t2 = p;
-                    t3 = ").";
-                }
-            }
-            else {
-                // warn (msg)
-                if (*the_str) {
-                    t1 = the_str;
-                }
-                // warn ()
-                else {
-                    t1 = "Something's wrong.";
-                }
-            }
-        }
+
+    if (do_perr) {
+        errno = en;
+        f_strbuf_append (&b, " (");
+        f_strbuf_append_color (&b, perr (), F_COLOR_BRIGHT_RED);
+        f_strbuf_append (&b, ").");
     }
+    f_strbuf_append_c (&b, '\n');
 
-    fprintf (stderr, "%s %s%s%s%s%s%s%s\n", bullet, t1, t2, t3, t4, t5, t6, t7);
+    _emit (F_OUT_WARN, b.buf, b.len);
+    f_strbuf_free (&b);
+}
 
-    if (fl) free (fl);
-    if (p) free (p);
-    free (the_str);
-    free (bullet);
+static bool _colors_on () {
+    if (_disable_colors)
+        return false;
+    // benign race: every thread would store the same thing.
+    if (_stdout_tty == -1)
+        _stdout_tty = isatty (fileno (stdout));
+    return _stdout_tty;
 }
 
 static char *_color (const char *s, int idx) {
-    char *t = str (strlen (s) + 1 + 4 + 5);
-    bool disable = _disable_colors | ! isatty (fileno (stdout));
-    char *a = disable ? "" : COL[idx];
-    char *b = disable ? "" : COL[0];
-    sprintf (t, "%s%s%s", a, s, b );
+    int len = strlen (s) + 1 + COLOR_LENGTH + COLOR_LENGTH_RESET;
+    char *t = str (len);
+    f_color_buf (t, len, s, idx);
     return t;
 }
 
+static void _static_str_thread_exit (void *mem) {
+    (void) mem;
+    _static_strings_free ();
+}
+
+static void _static_str_key_init () {
+    pthread_key_create (&_static_str_key, _static_str_thread_exit);
+}
+
 static void _static_str_init () {
-    _static_strs[0] = &_s;
-    _static_strs[1] = &_t;
-    _static_strs[2] = &_u;
-    _static_strs[3] = &_v;
-    _static_strs[4] = &_w;
-    _static_strs[5] = &_x;
-    _static_strs[6] = &_y;
-    _static_strs[7] = &_z;
+    pthread_once (&_static_str_once, _static_str_key_init);
 
-    for (int i = 0; i < NUM_STATIC_STRINGS; i++) {
-        *_static_strs[i] = f_malloc (sizeof (char) * STATIC_STR_LENGTH);
-    }
+    _static_str_num = _static_str_num_conf;
+    _static_str_len = _static_str_len_conf;
+    // + 1: scratch.
+    _static_str_mem = f_calloc (_static_str_num + 1, sizeof (char) * _static_str_len);
 
+    char **named[NUM_STATIC_STRINGS] = { &_s, &_t, &_u, &_v, &_w, &_x, &_y, &_z };
+    for (int i = 0; i < NUM_STATIC_STRINGS; i++)
+        *named[i] = _static_str_mem + i * _static_str_len;
+
+    _static_str_idx = -1;
+    _static_str_initted = true;
+    pthread_setspecific (_static_str_key, _static_str_mem);
+}
+
+static void _static_str_ensure () {
+    if (!_static_str_initted)
+        _static_str_init ();
 }
 
-static void _color_static (const char *c) {
-    int l = strlen (c);
-    if (l > STATIC_STR_LENGTH - 1) {
-        warn ("static string truncated (%s)", c);
-        l = STATIC_STR_LENGTH - 1;
+/* Through the scratch slot, like spr: s can be a static string.
+ */
+static void _color_static (const char *s, int idx) {
+    _static_str_ensure ();
+    char *scratch = _static_str_mem + _static_str_num * _static_str_len;
+    int l = f_color_buf (scratch, _static_str_len, s, idx);
+    if (l > _static_str_len - 1) {
+        warn ("static string truncated (%s)", scratch);
+        l = _static_str_len - 1;
     }
-    char **ptr = _get_static_str_ptr ();
-    // include null
-    memcpy (*ptr, c, l + 1);
+    memcpy (_get_static_str_ptr (), scratch, l + 1);
 }
 
-static char **_get_static_str_ptr () {
-    _static_str_idx = (_static_str_idx+1) % NUM_STATIC_STRINGS;
-    return _static_strs[_static_str_idx];
+static char *_get_static_str_ptr () {
+    _static_str_idx = (_static_str_idx+1) % _static_str_num;
+    return _static_str_mem + _static_str_idx * _static_str_len;
 }
 
 static void _sys_say (const char *cmd) {
-    char *bullet = get_bullet ();
-    char *new = str (strlen (cmd) + strlen (bullet) + COLOR_LENGTH + COLOR_LENGTH_RESET + 2 + 1);
-    char *c = G_ (bullet);
-    sprintf (new, "%s %s", c, cmd);
-    say (new);
-    free (new);
-    free (c);
+    f_strbuf b;
+    f_strbuf_init (&b);
+    f_strbuf_append_color (&b, get_bullet (), F_COLOR_GREEN);
+    f_strbuf_append_c (&b, ' ');
+    f_strbuf_append (&b, cmd);
+    f_strbuf_append_c (&b, '\n');
+    _emit (F_OUT_SYS, b.buf, b.len);
+    f_strbuf_free (&b);
 }
 
 static void _static_strings_free () {
     if (!_static_str_initted) return;
-    for (int i = 0; i < NUM_STATIC_STRINGS; i++) {
-        char **c = _static_strs[i];
-        char *cc = *c;
-        free (cc);
-    }
+    pthread_setspecific (_static_str_key, NULL);
+    f_free (_static_str_mem);
+    _static_str_mem = NULL;
+    _s = _t = _u = _v = _w = _x = _y = _z = NULL;
     _static_str_initted = false;
 }
@@ -8,11 +8,14 @@
 #define FISH_UTIL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #ifndef DEBUG_LENGTH
  #define DEBUG_LENGTH 200
@@ -24,18 +27,143 @@
 /* ##__VA_ARGS__ to swallow the preceding comma if omitted.
  */
 
-#ifdef DEBUG
+/* Log levels.
+ *
+ * Anything below F_LOG_MIN_LEVEL is compiled out. It defaults to
+ * F_LOG_DEBUG if DEBUG is defined and F_LOG_INFO otherwise; define it as
+ * F_LOG_DEBUG to keep debug statements in a production build.
+ *
+ * At runtime, debug is checked against the level before its arguments are
+ * evaluated, and so are the warn macros (iwarn, warn, piep ...). info
+ * checks inside. err and ierr always print. The level starts at
+ * F_LOG_DEBUG and can be set with f_log_level or the FISH_LOG environment
+ * variable, which also takes per-module levels, with a module being the
+ * basename of the source file, with or without extension:
+ *
+ *   FISH_LOG=warn,vec.c=debug,regex=info
+ */
+#define F_LOG_DEBUG     1
+#define F_LOG_INFO      2
+#define F_LOG_WARN      3
+#define F_LOG_ERR       4
+
+#ifndef F_LOG_MIN_LEVEL
+# ifdef DEBUG
+#  define F_LOG_MIN_LEVEL F_LOG_DEBUG
+# else
+#  define F_LOG_MIN_LEVEL F_LOG_INFO
+# endif
+#endif
+
+/* The lowest level anything (global or module) wants; 0 until FISH_LOG has
+ * been read. Only sites at or above it call _f_log_on.
+ */
+extern int _f_log_threshold;
+// the flight recorder wants debug messages even if they're filtered.
+extern bool _f_flight_debug;
+
+/* Output formats for _complain, info and debug (f_log_format).
+ *
+ * F_LOG_FORMAT_JSON: one object per line:
+ *   {"ts":1700000000.123456,"level":"warn","file":"x.c","line":12,"errno":null,"msg":"..."}
+ * file is null for non-internal messages, errno is the system error text
+ * for the _perr variants, otherwise null.
+ *
+ * F_LOG_FORMAT_BINARY: a struct f_log_record (host byte order), followed
+ * by file, errno text and message, without terminators. len covers the
+ * whole record.
+ *
+ * Both are written with a single write and never colored.
+ */
+#define F_LOG_FORMAT_TEXT       0
+#define F_LOG_FORMAT_JSON       1
+#define F_LOG_FORMAT_BINARY     2
+
+struct f_log_record {
+    uint32_t len;
+    uint32_t line;
+    uint64_t ts_ns;
+    uint32_t msg_len;
+    uint16_t file_len;
+    uint16_t errno_len;
+    uint8_t level;
+    uint8_t pad[7];
+};
+
+/* Each call site caches the level for its file (global or module), so
+ * only the first check after a change looks through the modules. state
+ * is generation << 8 | level, 0 until filled in.
+ */
+struct f_log_cache {
+    const char *file;
+    long state;
+};
+
+#define _f_log_enabled_at(cache, level) \
+    ((level) >= F_LOG_MIN_LEVEL && (level) >= _f_log_threshold && _f_log_cache_on (cache, level))
+
+#define f_log_enabled(level) ({ \
+    static struct f_log_cache _f_log_cache = { __FILE__, 0 }; \
+    _f_log_enabled_at (&_f_log_cache, level); \
+})
+
+#if F_LOG_MIN_LEVEL <= F_LOG_DEBUG
 # define debug(x, ...) do { \
-    char *pref = f_get_warn_prefix(__FILE__, __LINE__); \
-    char *dbg = str(DEBUG_LENGTH); \
-    snprintf (dbg, DEBUG_LENGTH, x, ##__VA_ARGS__); \
-    info("%s:debug:%s", pref, dbg); \
-    free(dbg); \
+    static struct f_site _f_site = F_SITE_INIT; \
+    if (_f_flight_debug || _f_log_enabled_at (&_f_site.log, F_LOG_DEBUG)) \
+        _debug (&_f_site, x, ##__VA_ARGS__); \
 } while (0)
 #else
-# define debug(...) {}
+# define debug(...) do { } while (0)
 #endif
 
+/* Per call site rate limiting for the internal warnings (iwarn and
+ * friends, so also piep and co.)
+ *
+ * Each site gets a static struct f_site from the macro. With
+ * f_warn_rate_limit (burst, interval_ms) set, a site can print burst
+ * messages and then gets burst more per interval_ms; the rest are counted
+ * and reported as '(suppressed N similar messages)' the next time the site
+ * prints, once it's been quiet for interval_ms (noticed by the next warning
+ * from anywhere), or at fish_util_cleanup. Off by default.
+ *
+ * A suppressed message costs an atomic decrement, a coarse clock read and
+ * an atomic increment; its arguments are not evaluated.
+ *
+ * The site also caches its '<file>:<line>' prefix, plain and colored, built
+ * the first time it prints (also used by ierr and debug).
+ */
+struct f_site {
+    const char *file;
+    unsigned int line;
+    int tokens;
+    long last;
+    unsigned long suppressed;
+    int listed;
+    struct f_site *next;
+    int prefix_state;
+    const char *prefix[2];
+    struct f_log_cache log;
+};
+
+#define F_SITE_INIT { .file = __FILE__, .line = __LINE__, .log = { __FILE__, 0 } }
+
+extern int _f_rate_burst;
+bool _f_site_refill (struct f_site *site);
+
+static inline bool _f_site_allow (struct f_site *site) {
+    if (!_f_rate_burst)
+        return true;
+    if (__atomic_load_n (&site->tokens, __ATOMIC_RELAXED) > 0 &&
+        __atomic_sub_fetch (&site->tokens, 1, __ATOMIC_RELAXED) >= 0)
+        return true;
+    return _f_site_refill (site);
+}
+
+#define _f_site_check(level) \
+    static struct f_site _f_site = F_SITE_INIT; \
+    if (_f_log_enabled_at (&_f_site.log, level) && _f_site_allow (&_f_site))
+
 /* This should disapper (see fish-lib-asound)  XX
  */
 #define _FISH_WARN_LENGTH 500
@@ -97,15 +225,18 @@
  */
 
 #define iwarn(format...) do { \
-    _complain(__FILE__, __LINE__, false, false, format); \
+    _f_site_check (F_LOG_WARN) \
+        _complain_site(&_f_site, false, false, format); \
 } while (0)
 
 #define iwarn_aserr(format...) do { \
-    _complain(__FILE__, __LINE__, true, false, format); \
+    _f_site_check (F_LOG_ERR) \
+        _complain_site(&_f_site, true, false, format); \
 } while (0)
 
 #define ierr(format...) do { \
-    _complain(__FILE__, __LINE__, true, false, format); \
+    static struct f_site _f_site = F_SITE_INIT; \
+    _complain_site(&_f_site, true, false, format); \
     _err(); \
 } while (0)
 
@@ -114,24 +245,29 @@
 } while (0)
 
 #define iwarn_perr(format...) do { \
-    _complain(__FILE__, __LINE__, false, true, format); \
+    _f_site_check (F_LOG_WARN) \
+        _complain_site(&_f_site, false, true, format); \
 } while (0)
 
 #define iwarn_aserr_perr(format...) do { \
-    _complain(__FILE__, __LINE__, true, true, format); \
+    _f_site_check (F_LOG_ERR) \
+        _complain_site(&_f_site, true, true, format); \
 } while (0)
 
 #define ierr_perr(format...) do { \
-    _complain(__FILE__, __LINE__, true, true, format); \
+    static struct f_site _f_site = F_SITE_INIT; \
+    _complain_site(&_f_site, true, true, format); \
     _err(); \
 } while (0)
 
 #define warn(format...) do { \
-    _complain("", 0, false, false, format); \
+    if (f_log_enabled (F_LOG_WARN)) \
+        _complain("", 0, false, false, format); \
 } while (0)
 
 #define warn_aserr(format...) do { \
-    _complain("", 0, true, false, format); \
+    if (f_log_enabled (F_LOG_ERR)) \
+        _complain("", 0, true, false, format); \
 } while (0)
 
 #define err(format...) do { \
@@ -140,11 +276,13 @@
 } while (0)
 
 #define warn_perr(format...) do { \
-    _complain("", 0, false, true, format); \
+    if (f_log_enabled (F_LOG_WARN)) \
+        _complain("", 0, false, true, format); \
 } while (0)
 
 #define warn_aserr_perr(format...) do { \
-    _complain("", 0, true, true, format); \
+    if (f_log_enabled (F_LOG_ERR)) \
+        _complain("", 0, true, true, format); \
 } while (0)
 
 #define err_perr(format...) do { \
@@ -238,12 +376,17 @@
 #define F_APPEND        0x80000
 #define F_READ_WRITE_NO_TRUNC   0x100000
 #define F_READ_WRITE_TRUNC      0x200000
+#define F_POOL                  0x400000
+#define F_ALLOC_STATS           0x800000
+#define F_STDERR               0x1000000
+#define F_SPLICE               0x2000000
 
 /* Static strings.
  * These names should not be used for any other variables.
+ * They are per thread, so each thread has to call _ () before using them.
  * XX
  */
-extern char *_s, *_t, *_u, *_v, *_w, *_x, *_y, *_z;
+extern __thread char *_s, *_t, *_u, *_v, *_w, *_x, *_y, *_z;
 
 char *f_dirname (const char *s);
 void *f_malloc (size_t s);
@@ -251,6 +394,7 @@ void *f_calloc (size_t nmemb, size_t size);
 void *f_realloc (void *ptr, size_t size);
 char *f_strdup (const char *s);
 char *f_strndup (const char *s, size_t n);
+void f_free (void *ptr);
 
 #define f_malloct(type) \
     f_malloc(sizeof(type))
@@ -270,6 +414,192 @@ char *f_strndup (const char *s, size_t n);
 #define f_reallocv(ptr, var) \
     f_realloc(ptr, sizeof var)
 
+/* Allocation accounting (see fish_util_init_f).
+ * hist[i] counts requests up to 16 << i bytes; the last bucket is for
+ * everything bigger.
+ * outstanding is what the f_malloc family handed out minus what came back
+ * through f_free / f_realloc: memory released with plain free () stays in
+ * it, so it's an upper bound on what's really in use. outstanding_peak is
+ * its highest value.
+ */
+#define F_ALLOC_HIST_BUCKETS 16
+
+enum f_alloc_funcs {
+    F_ALLOC_MALLOC,
+    F_ALLOC_CALLOC,
+    F_ALLOC_REALLOC,
+    F_ALLOC_STRDUP,
+    F_ALLOC_STRNDUP,
+    F_ALLOC_NUM_FUNCS,
+};
+
+struct f_alloc_stats {
+    unsigned long calls[F_ALLOC_NUM_FUNCS];
+    unsigned long bytes[F_ALLOC_NUM_FUNCS];
+    long outstanding;
+    long outstanding_peak;
+    unsigned long hist[F_ALLOC_HIST_BUCKETS];
+};
+
+void f_alloc_stats_get (struct f_alloc_stats *stats);
+void f_alloc_stats_reset ();
+void f_alloc_stats_dump (FILE *f);
+bool f_alloc_stats_enabled ();
+
+/* Sampling heap profiler for the f_malloc family and the pool.
+ */
+#define F_HEAP_PROFILE_PPROF        0x01
+#define F_HEAP_PROFILE_COLLAPSED    0x02
+
+void f_heap_profile_start (long sample_bytes);
+void f_heap_profile_stop ();
+void f_heap_profile_reset ();
+bool f_heap_profile_write (FILE *f, int flags);
+
+/* Arena: many small allocations from big blocks, freed all at once.
+ */
+typedef struct f_arena f_arena;
+
+f_arena *f_arena_new (size_t block_size);
+void *f_arena_alloc (f_arena *a, size_t size);
+char *f_arena_strdup (f_arena *a, const char *s);
+void f_arena_reset (f_arena *a);
+void f_arena_destroy (f_arena *a);
+
+/* Async logging (f_async_start).
+ */
+#define F_ASYNC_BLOCK           0x01
+#define F_ASYNC_DROP            0x02
+#define F_ASYNC_DROP_REPORT     0x04
+
+bool f_async_start (size_t ring_size, int flags);
+void f_async_flush ();
+void f_async_stop ();
+long f_async_dropped ();
+
+/* Output sinks.
+ *
+ * Each class of library output can be routed to a sink with f_out_sink;
+ * NULL goes back to stdout/stderr (or the async ring).
+ *
+ * f_sink_fd, f_sink_file: buffered per thread, bufsize bytes (0: 64K).
+ * Flushed when full, every flush_ms if > 0 (by a background thread), on
+ * f_out_flush, at thread exit and at exit / fish_util_cleanup.
+ * f_sink_memory: ring of the last size bytes, for tests and crash dumps;
+ * f_sink_memory_read copies out the oldest first.
+ * f_sink_callback: func is called with each message, unbuffered.
+ * f_sink_destroy waits for threads writing to the sink to finish (so not
+ * from inside its callback); messages which come in meanwhile go to
+ * stdout/stderr.
+ */
+enum f_out_classes {
+    F_OUT_SAY,
+    F_OUT_INFO,
+    F_OUT_ASK,
+    F_OUT_SYS,
+    F_OUT_WARN,
+    F_OUT_DEBUG,
+    F_OUT_NUM_CLASSES,
+};
+
+typedef struct f_sink f_sink;
+typedef void (*f_sink_func) (int class, const char *buf, size_t len, void *data);
+
+f_sink *f_sink_fd (int fd, size_t bufsize, int flush_ms);
+f_sink *f_sink_file (const char *path, size_t bufsize, int flush_ms);
+f_sink *f_sink_memory (size_t size);
+f_sink *f_sink_callback (f_sink_func func, void *data);
+size_t f_sink_memory_read (f_sink *sink, char *buf, size_t len);
+void f_sink_memory_clear (f_sink *sink);
+void f_sink_destroy (f_sink *sink);
+void f_out_sink (int class, f_sink *sink);
+void f_out_flush ();
+
+/* Flight recorder: each thread keeps its last size bytes (0: 64K) of
+ * info, warn and debug output in a ring, written without locks. The rings
+ * are dumped to stderr by _err (err, ierr, ...) and, with
+ * F_FLIGHT_SIGNALS, by a SIGSEGV / SIGABRT handler, which then lets the
+ * signal through.
+ *
+ * F_FLIGHT_DEBUG: also record debug messages which are filtered out by the
+ * log level (but not those compiled out, see F_LOG_MIN_LEVEL).
+ *
+ * f_flight_dump is async-signal-safe.
+ */
+#define F_FLIGHT_SIGNALS        0x01
+#define F_FLIGHT_DEBUG          0x02
+
+bool f_flight_recorder_start (size_t size, int flags);
+void f_flight_recorder_stop ();
+void f_flight_dump (int fd);
+
+/* Big buffers straight from mmap, on huge pages where possible.
+ */
+#define F_BIG_POPULATE 0x01
+
+void *f_big_alloc (size_t size, int flags);
+void *f_big_realloc (void *ptr, size_t size, int flags);
+void f_big_free (void *ptr);
+size_t f_big_size (void *ptr);
+void f_big_config (size_t threshold, int flags);
+size_t f_big_threshold ();
+int f_big_flags ();
+
+/* Interned strings: one canonical, read-only copy of each distinct
+ * string, so they can be compared by pointer.
+ */
+const char *f_intern (const char *s);
+const char *f_intern_n (const char *s, size_t len);
+const char *f_intern_lookup (const char *s);
+size_t f_intern_count ();
+
+/* Growable string. buf is always \0-terminated and len is its strlen.
+ * Strings up to F_STRBUF_INLINE - 1 chars live in the struct itself.
+ */
+#define F_STRBUF_INLINE 256
+
+typedef struct f_strbuf {
+    char *buf;
+    size_t len;
+    size_t cap;
+    f_arena *arena;
+    char inline_buf[F_STRBUF_INLINE];
+} f_strbuf;
+
+void f_strbuf_init (f_strbuf *b);
+void f_strbuf_init_arena (f_strbuf *b, f_arena *a);
+void f_strbuf_reserve (f_strbuf *b, size_t extra);
+void f_strbuf_append (f_strbuf *b, const char *s);
+void f_strbuf_append_n (f_strbuf *b, const char *s, size_t n);
+void f_strbuf_append_c (f_strbuf *b, char c);
+int f_strbuf_appendf (f_strbuf *b, const char *format, ...);
+int f_strbuf_vappendf (f_strbuf *b, const char *format, va_list arglist);
+void f_strbuf_truncate (f_strbuf *b, size_t len);
+void f_strbuf_reset (f_strbuf *b);
+char *f_strbuf_detach (f_strbuf *b);
+void f_strbuf_free (f_strbuf *b);
+
+/* Pool for small, short-lived strings (see fish_util_init_f).
+ * Blocks are per thread: free them on the thread which allocated them, and
+ * with f_pool_free, not free.
+ */
+#define F_POOL_NUM_CLASSES 6
+
+struct f_pool_stats {
+    size_t size;            // usable bytes per block
+    long allocs;
+    long frees;
+    long slabs;
+    long in_use;
+    long free;              // blocks on the free list
+};
+
+void *f_pool_malloc (size_t size);
+void f_pool_free (void *ptr);
+char *f_pool_str (int length);
+int f_pool_get_stats (struct f_pool_stats *stats);
+bool f_pool_enabled ();
+
 void fish_util_cleanup ();
 
 void f_signame (int signal, char **name, char **desc);
@@ -277,6 +607,7 @@ void f_signame (int signal, char **name, char **desc);
 /* Only necessary to restart after a cleanup.
  */
 void fish_util_init ();
+void fish_util_init_f (int flags);
 
 /* Functions without f_ prefix.
  */
@@ -297,6 +628,143 @@ int sys (const char *cmd);
 int sysclose (FILE *f);
 int sysclose_f (FILE *f, const char *cmd, int flags);
 
+/* Timeouts and resource usage for commands.
+ *
+ * f_sys_timeout (secs, grace): commands which run longer than secs get
+ * SIGTERM, and SIGKILL grace seconds later; their status is then
+ * F_SYS_TIMEOUT. 0 turns it off. Counted from the start of the command;
+ * for sysr / sysw it's enforced when waiting in sysclose.
+ *
+ * f_sys_last_usage: what the calling thread's last finished command cost
+ * (from wait4), false if there wasn't one.
+ */
+#define F_SYS_TIMEOUT -2
+
+struct f_sys_usage {
+    double wall;
+    double user;
+    double sys;
+    long maxrss; // KB
+    long minflt;
+    long majflt;
+    long nvcsw;
+    long nivcsw;
+    bool timed_out;
+};
+
+void f_sys_timeout (double secs, double grace);
+bool f_sys_last_usage (struct f_sys_usage *usage);
+
+/* Coprocess mode: sys, sysr and sys_capture(_f) (without err) send their
+ * commands to one long-lived /bin/sh instead of starting a new one each
+ * time. Each command runs in a subshell with stdin from /dev/null, cd'd
+ * to our current directory; its pid and exit status come back on a
+ * separate fd. The shell is restarted when the environment has changed
+ * since it started, or when it has died (then the command is tried once
+ * more). sysr gives a FILE over the command's finished output (a memfd,
+ * so fileno works). f_sys_last_usage only has wall time.
+ *
+ * The shell runs in its own process group, so commands don't get the
+ * terminal's signals (^C); on f_sys_timeout the whole group, shell
+ * included, gets SIGTERM and then SIGKILL. Something the command leaves
+ * running in the background can still write into the next command's
+ * output. f_sys_coproc (false) and f_sys_coproc_stop stop the shell.
+ */
+void f_sys_coproc (bool b);
+void f_sys_coproc_stop ();
+
+/* Same, but run argv directly with posix_spawn, without fork or a shell.
+ * argv[0] is looked up in PATH if it has no slash (see
+ * f_sys_path_cache). Close with sysclose.
+ */
+FILE *sysv_r (char *const argv[]);
+FILE *sysv_w (char *const argv[]);
+int sysv (char *const argv[]);
+pid_t f_sys_pid (FILE *f);
+
+/* Run a command and collect its output in an f_strbuf, see
+ * sysv_capture_f.
+ */
+int sys_capture (const char *cmd, f_strbuf *out);
+int sys_capture_f (const char *cmd, f_strbuf *out, f_strbuf *err, size_t max, int flags);
+int sysv_capture (char *const argv[], f_strbuf *out);
+int sysv_capture_f (char *const argv[], f_strbuf *out, f_strbuf *err, size_t max, int flags);
+
+/* Both ends: the command's stdin and stdout as non-blocking fds (*in_fd,
+ * *out_fd). Returns the pid, or -1.
+ *
+ * sysrw_pump feeds it in_len bytes of in, collects its output in out (if
+ * not NULL), closes both fds and waits for it, returning the status as
+ * sysclose_f. With F_SPLICE the input is handed to the pipe with vmsplice
+ * instead of being copied: the pipe then refers to the caller's pages, so
+ * in must not be modified or freed (by another thread, say) until the
+ * command has consumed it, which is at the latest when sysrw_pump
+ * returns.
+ */
+pid_t sysrw (const char *cmd, int *in_fd, int *out_fd);
+pid_t sysv_rw (char *const argv[], int *in_fd, int *out_fd);
+int sysrw_pump (pid_t pid, int in_fd, int out_fd, const char *in, size_t in_len, f_strbuf *out, int flags);
+
+/* Pipeline of argv vectors, connected directly by pipes, each stage
+ * spawned without a shell.
+ *
+ * f_pipeline_start flags: F_WRITE gives us the first stage's stdin
+ * (f_pipeline_head), F_READ the last one's stdout (f_pipeline_tail);
+ * otherwise they're inherited. Close those with f_pipeline_close_head /
+ * _tail (not close), e.g. to send EOF; f_pipeline_wait closes whatever is
+ * still open, waits for all stages and
+ * returns the status (as sysclose_f) of the last stage which failed
+ * (128 + signal for one which was killed), or 0 (pipefail).
+ * f_pipeline_status gives each stage's, the same way. With f_sys_timeout,
+ * stages still running at the timeout all get SIGTERM together, and
+ * SIGKILL after the grace period. If a stage can't be started, the ones
+ * before it are killed and f_pipeline_start returns false.
+ */
+typedef struct f_pipeline f_pipeline;
+
+f_pipeline *f_pipeline_new ();
+void f_pipeline_add (f_pipeline *p, char *const argv[]);
+bool f_pipeline_start (f_pipeline *p, int flags);
+int f_pipeline_head (f_pipeline *p);
+int f_pipeline_tail (f_pipeline *p);
+void f_pipeline_close_head (f_pipeline *p);
+void f_pipeline_close_tail (f_pipeline *p);
+int f_pipeline_wait (f_pipeline *p, int flags);
+int f_pipeline_num (f_pipeline *p);
+int f_pipeline_status (f_pipeline *p, int i);
+void f_pipeline_destroy (f_pipeline *p);
+
+/* Job runner: add commands (run by /bin/sh) or argv vectors, then
+ * f_jobs_run runs them, at most max at a time (0: number of CPUs), and
+ * collects each one's output, status and wall time.
+ *
+ * f_jobs_run flags: F_QUIET (don't complain about failed jobs), F_STDERR
+ * (collect stderr with stdout). Returns the number of jobs which failed.
+ */
+struct f_job {
+    char *cmd;
+    pid_t pid;
+    int status; // as sysclose_f; -1 if it didn't start, F_SYS_TIMEOUT
+    int wait_status; // from waitpid
+    int signal;
+    char *signame;
+    bool core_dumped;
+    double wall; // seconds
+    struct f_sys_usage usage;
+    f_strbuf out;
+};
+
+typedef struct f_jobs f_jobs;
+
+f_jobs *f_jobs_new (int max);
+int f_jobs_add (f_jobs *jobs, const char *cmd);
+int f_jobs_addv (f_jobs *jobs, char *const argv[]);
+int f_jobs_run (f_jobs *jobs, int flags);
+int f_jobs_num (f_jobs *jobs);
+struct f_job *f_jobs_get (f_jobs *jobs, int i);
+void f_jobs_destroy (f_jobs *jobs);
+void f_sys_path_cache (bool b);
+
 FILE *safeopen (const char *filespec);
 FILE *safeopen_f (const char *filespec, int flags);
 
@@ -306,6 +774,27 @@ wchar_t *d8 (char *s);
 
 char *str (int length);
 
+/* For the color functions which take a color.
+ */
+enum f_colors {
+    F_COLOR_RED = 1,
+    F_COLOR_BRIGHT_RED,
+    F_COLOR_GREEN,
+    F_COLOR_BRIGHT_GREEN,
+    F_COLOR_YELLOW,
+    F_COLOR_BRIGHT_YELLOW,
+    F_COLOR_BLUE,
+    F_COLOR_BRIGHT_BLUE,
+    F_COLOR_CYAN,
+    F_COLOR_BRIGHT_CYAN,
+    F_COLOR_MAGENTA,
+    F_COLOR_BRIGHT_MAGENTA,
+};
+
+int f_color_buf (char *buf, size_t len, const char *s, int color);
+void f_strbuf_append_color (f_strbuf *b, const char *s, int color);
+int f_color_iov (struct iovec *iov, const char *s, int color);
+
 char *R_ (const char *s);
 char *BR_ (const char *s);
 char *G_ (const char *s);
@@ -354,13 +843,18 @@ bool f_atoi (const char *s, int *ret);
 int f_int_length (long i);
 
 bool f_socket_make_named (const char *filename, int *socket);
+bool f_socket_listen (int socket, int backlog);
 bool f_socket_make_client (int socket, int *client_socket);
 
 /* num_read can be NULL.
+ * On a non-blocking socket with nothing to read, returns false with errno
+ * EAGAIN, without complaining. Same for EINTR and ECONNRESET.
  */
 bool f_socket_read (int client_socket, ssize_t *num_read, char *buf, size_t max_length);
 
 /* num_written can be NULL.
+ * Same for EAGAIN, EINTR and ECONNRESET. A closed peer gives EPIPE (also
+ * quietly), not SIGPIPE.
  */
 bool f_socket_write (int client_socket, ssize_t *num_written, const char *buf, size_t len);
 
@@ -369,7 +863,80 @@ bool f_socket_close (int client_socket);
 bool f_socket_unix_message (const char *filename, const char *msg);
 bool f_socket_unix_message_f (const char *filename, const char *msg, char *response, int buf_length);
 
+/* Event loop (epoll, edge-triggered) for non-blocking sockets.
+ *
+ * f_loop_listen takes a listening socket (f_socket_make_named +
+ * f_socket_listen); each connection it accepts gets the callbacks and
+ * data. f_loop_add_fd adds a connected socket, e.g. a client's.
+ * Callbacks (any can be NULL):
+ *   accept: new connection.
+ *   readable: there's new data in f_conn_in; take it with f_conn_consume.
+ *   writable: output queued by f_conn_write has all gone out.
+ *   closed: the connection is closed (EOF, error, f_conn_close); c is
+ *   freed after it returns.
+ * f_conn_write writes what it can now and queues the rest. f_conn_close
+ * closes after the queued output is written. A connection with more than
+ * 16 MB of input which readable doesn't consume gets closed. When we're
+ * out of fds, waiting connections are accepted and dropped straight
+ * away, so they don't hang.
+ *
+ * Timers: f_loop_timer calls func after ms (every ms with repeat), and
+ * returns an id for f_loop_timer_cancel.
+ *
+ * f_loop_run returns after f_loop_stop, or when there are no connections
+ * (listeners count) or timers left; -1 on error. All of it is for one
+ * thread.
+ */
+typedef struct f_loop f_loop;
+typedef struct f_conn f_conn;
+typedef void (*f_conn_func) (f_conn *c);
+typedef void (*f_timer_func) (void *data);
+
+struct f_conn_callbacks {
+    f_conn_func accept;
+    f_conn_func readable;
+    f_conn_func writable;
+    f_conn_func closed;
+};
+
+f_loop *f_loop_new ();
+bool f_loop_listen (f_loop *loop, int socket, const struct f_conn_callbacks *cb, void *data);
+f_conn *f_loop_add_fd (f_loop *loop, int fd, const struct f_conn_callbacks *cb, void *data);
+int f_loop_timer (f_loop *loop, long ms, bool repeat, f_timer_func func, void *data);
+void f_loop_timer_cancel (f_loop *loop, int id);
+int f_loop_run (f_loop *loop);
+void f_loop_stop (f_loop *loop);
+int f_loop_num_conns (f_loop *loop);
+void f_loop_destroy (f_loop *loop);
+
+bool f_conn_write (f_conn *c, const char *buf, size_t len);
+void f_conn_close (f_conn *c);
+f_strbuf *f_conn_in (f_conn *c);
+void f_conn_consume (f_conn *c, size_t n);
+size_t f_conn_pending (f_conn *c);
+int f_conn_fd (f_conn *c);
+void *f_conn_data (f_conn *c);
+void f_conn_set_data (f_conn *c, void *data);
+f_loop *f_conn_loop (f_conn *c);
+
+/* Flags for f_time_hires_f, f_timestamp and f_log_timestamps_f.
+ * F_TIME_COARSE: CLOCK_REALTIME_COARSE (a few ms resolution, cheaper).
+ * F_TIME_MS, F_TIME_US: add milli / microseconds to the timestamp.
+ * F_TIME_UTC: UTC instead of local time.
+ */
+#define F_TIME_COARSE   0x01
+#define F_TIME_MS       0x02
+#define F_TIME_US       0x04
+#define F_TIME_UTC      0x08
+
+// "YYYY-MM-DD HH:MM:SS.uuuuuu" and then some.
+#define F_TIMESTAMP_LENGTH 40
+
 double f_time_hires ();
+double f_time_hires_f (int flags);
+int f_timestamp (char *buf, size_t len, int flags);
+void f_log_timestamps (bool b);
+void f_log_timestamps_f (bool b, int flags);
 double f_time_hires_old () __attribute__((deprecated));
 
 char *f_field (int width, const char *string, int max_len);
@@ -384,6 +951,9 @@ char *f_reverse_str (const char *orig, size_t len);
 char *f_comma (long n);
 
 int f_get_static_str_length ();
+int f_get_static_str_num ();
+char *f_get_static_str (int i);
+void f_static_str_config (int num, int length);
 
 bool f_set_utf8 ();
 bool f_set_utf8_f (int flags);
@@ -400,5 +970,15 @@ int f_get_max_color_length ();
 int f_get_color_reset_length ();
 
 void _complain (const char *file, unsigned int line, bool iserr, bool perr, const char *format, ...);
+void _complain_site (struct f_site *site, bool iserr, bool perr, const char *format, ...);
+void _debug (struct f_site *site, const char *format, ...);
+bool _f_log_on (const char *file, int level);
+bool _f_log_cache_on (struct f_log_cache *cache, int level);
+
+void f_log_level (int level);
+int f_log_get_level ();
+void f_log_format (int format);
+void f_warn_rate_limit (int burst, int interval_ms);
+bool f_log_module_level (const char *module, int level);
 
 #endif
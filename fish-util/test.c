@@ -1,5 +1,729 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include "fish-util.h"
 
+static int fails = 0;
+
+/* Straight to stderr: some of the tests reroute or filter the library's
+ * own output.
+ */
+#define check(x) do { \
+    if (! (x)) { \
+        fprintf (stderr, "%s:%d Check failed: %s\n", __FILE__, __LINE__, #x); \
+        fails++; \
+    } \
+} while (0)
+
+static void *pool_thread (void *arg) {
+    for (int i = 0; i < 1000; i++)
+        f_pool_free (f_pool_str (1 + i % 1000));
+    return arg;
+}
+
+static void test_pool () {
+    fish_util_init_f (F_POOL | F_ALLOC_STATS | F_QUIET);
+    check (f_pool_enabled ());
+    struct f_pool_stats ps[F_POOL_NUM_CLASSES], ps2[F_POOL_NUM_CLASSES];
+    check (f_pool_get_stats (ps) == F_POOL_NUM_CLASSES);
+
+    // the smallest class which fits, and a freed block comes right back.
+    void *a = f_pool_malloc (ps[0].size);
+    void *b = f_pool_malloc (ps[0].size + 1);
+    f_pool_get_stats (ps2);
+    check (ps2[0].in_use == ps[0].in_use + 1 && ps2[0].allocs == ps[0].allocs + 1);
+    check (ps2[1].in_use == ps[1].in_use + 1 && ps2[1].slabs >= 1);
+    f_pool_free (a);
+    check (f_pool_malloc (ps[0].size) == a);
+    f_pool_free (a);
+    f_pool_free (b);
+    f_pool_get_stats (ps2);
+    check (ps2[0].in_use == ps[0].in_use && ps2[0].frees == ps[0].frees + 2);
+    check (ps2[1].in_use == ps[1].in_use);
+
+    // too big for the pool: malloc, and no class sees it.
+    size_t big = ps[F_POOL_NUM_CLASSES - 1].size + 1;
+    void *c = f_pool_malloc (big);
+    f_pool_get_stats (ps2);
+    check (ps2[0].allocs == ps[0].allocs + 2 && ps2[1].allocs == ps[1].allocs + 1);
+    for (int i = 2; i < F_POOL_NUM_CLASSES; i++)
+        check (ps2[i].allocs == ps[i].allocs);
+    f_pool_free (c);
+
+    // threads give their slabs back when they exit.
+    struct f_alloc_stats st;
+    f_alloc_stats_get (&st);
+    long before = st.outstanding;
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create (&threads[i], NULL, pool_thread, NULL);
+    for (int i = 0; i < 4; i++)
+        pthread_join (threads[i], NULL);
+    f_alloc_stats_get (&st);
+    check (st.outstanding == before);
+
+    fish_util_init_f (0);
+}
+
+static void test_alloc_stats () {
+    fish_util_init_f (F_ALLOC_STATS | F_QUIET);
+    check (f_alloc_stats_enabled ());
+
+    f_alloc_stats_reset ();
+    struct f_alloc_stats st;
+    void *p = f_malloc (100);
+    char *d = f_strdup ("abc");
+    p = f_realloc (p, 5000);
+    f_alloc_stats_get (&st);
+    check (st.calls[F_ALLOC_MALLOC] == 1 && st.calls[F_ALLOC_STRDUP] == 1 && st.calls[F_ALLOC_REALLOC] == 1);
+    check (st.bytes[F_ALLOC_MALLOC] == 100 && st.bytes[F_ALLOC_STRDUP] == 4);
+    // 100 in the 128 bucket, 4 in the 16 one.
+    check (st.hist[3] >= 1 && st.hist[0] >= 1);
+    check (st.outstanding >= 5004 && st.outstanding_peak >= st.outstanding);
+    long peak = st.outstanding_peak;
+    f_free (p);
+    f_free (d);
+    f_alloc_stats_get (&st);
+    check (st.outstanding <= peak - 5004 && st.outstanding_peak == peak);
+
+    fish_util_init_f (0);
+}
+
+/* test is linked with -rdynamic, so library frames would show up by name.
+ */
+static void test_heap_profile () {
+    // sampling every byte: everything shows up.
+    f_heap_profile_start (1);
+    for (int i = 0; i < 100; i++) {
+        f_free (f_malloc (1000));
+        f_free (str (100));
+        f_pool_free (f_pool_str (50));
+    }
+    FILE *f = tmpfile ();
+    check (f_heap_profile_write (f, F_HEAP_PROFILE_COLLAPSED));
+    f_heap_profile_stop ();
+    check (ftell (f) > 0);
+    rewind (f);
+    char line[4096];
+    int n = 0;
+    while (fgets (line, sizeof line, f)) {
+        n++;
+        // the leaf is the caller, never one of the wrappers.
+        check (! strstr (line, "str ") && ! strstr (line, "malloc "));
+    }
+    check (n > 0);
+    fclose (f);
+    f_heap_profile_reset ();
+}
+
+static void test_static_str () {
+    int num = f_get_static_str_num (), len = f_get_static_str_length ();
+    f_static_str_config (12, 64);
+    check (f_get_static_str_num () == 12 && f_get_static_str_length () == 64);
+    _ ();
+    spr ("%d", 42);
+    check (! strcmp (_s, "42") && f_get_static_str (11) != NULL);
+    f_static_str_config (num, len);
+    check (f_get_static_str_num () == num && f_get_static_str_length () == len);
+}
+
+static void test_strbuf () {
+    f_strbuf b;
+    f_strbuf_init (&b);
+    for (int i = 0; i < 100; i++)
+        f_strbuf_appendf (&b, "%d,", i);
+    check (b.len > F_STRBUF_INLINE && b.len == strlen (b.buf));
+    check (! strncmp (b.buf, "0,1,2,", 6) && ! strcmp (b.buf + b.len - 3, "99,"));
+    char *d = f_strbuf_detach (&b);
+    check (strlen (d) == 290 && b.len == 0);
+    f_free (d);
+    f_strbuf_free (&b);
+
+    f_arena *a = f_arena_new (0);
+    f_strbuf_init_arena (&b, a);
+    for (int i = 0; i < 1000; i++)
+        f_strbuf_append (&b, "arena ");
+    check (b.len == 6000);
+    check (! strcmp (f_arena_strdup (a, "copy"), "copy"));
+    f_arena_destroy (a);
+}
+
+static void test_color () {
+    // color or not (tty), the text is there, and cut like snprintf.
+    char buf[64];
+    int n = f_color_buf (buf, sizeof buf, "red", F_COLOR_RED);
+    check (n >= 3 && (int) strlen (buf) == n && strstr (buf, "red"));
+    check (f_color_buf (buf, 4, "red", F_COLOR_RED) == n && strlen (buf) == 3);
+    check (f_color_buf (buf, sizeof buf, "x", 99) == 1 && ! strcmp (buf, "x"));
+    struct iovec iov[3];
+    n = f_color_iov (iov, "green", F_COLOR_GREEN);
+    check ((n == 1 || n == 3) && iov[n == 1 ? 0 : 1].iov_len == 5);
+}
+
+static void test_intern () {
+    const char *in = f_intern ("interned");
+    char copy[] = "interned";
+    size_t num = f_intern_count ();
+    check (f_intern (copy) == in && in != copy && f_intern_count () == num);
+    check (f_intern_n ("interned too", 8) == in);
+    check (f_intern_lookup ("interned") == in && f_intern_lookup ("not interned") == NULL);
+}
+
+static void test_big_alloc () {
+    size_t mb = 1 << 20;
+    char *big = f_big_alloc (4 * mb, F_BIG_POPULATE);
+    check (big && f_big_size (big) >= 4 * mb);
+    memset (big, 'x', 4 * mb);
+    big = f_big_realloc (big, 64 * mb, 0);
+    check (big && f_big_size (big) >= 64 * mb);
+    check (big && big[0] == 'x' && big[4 * mb - 1] == 'x');
+    f_big_free (big);
+}
+
+/* The smallest ring holds a few dozen lines, so the producer has to wait
+ * for the writer over and over.
+ */
+static void test_async () {
+    // stdout into a file for a moment.
+    fflush (stdout);
+    FILE *f = tmpfile ();
+    int saved = dup (1);
+    dup2 (fileno (f), 1);
+    check (f_async_start (1024, F_ASYNC_BLOCK));
+    for (int i = 0; i < 1000; i++)
+        info ("async %d", i);
+    f_async_stop ();
+    dup2 (saved, 1);
+    close (saved);
+
+    rewind (f);
+    char line[256];
+    int lines = 0;
+    bool in_order = true;
+    while (fgets (line, sizeof line, f)) {
+        char *p = strstr (line, "async ");
+        if (! p)
+            continue;
+        if (atoi (p + 6) != lines)
+            in_order = false;
+        lines++;
+    }
+    fclose (f);
+    check (lines == 1000 && in_order);
+    check (f_async_dropped () == 0);
+}
+
+static char mem[4096];
+
+static const char *mem_read (f_sink *sink) {
+    size_t n = f_sink_memory_read (sink, mem, sizeof mem - 1);
+    mem[n] = '\0';
+    f_sink_memory_clear (sink);
+    return mem;
+}
+
+// info and warn into a memory sink for a test; NULL puts them back.
+static f_sink *mem_route (f_sink *sink) {
+    f_out_sink (F_OUT_INFO, sink);
+    f_out_sink (F_OUT_WARN, sink);
+    return sink;
+}
+
+static void test_log_level () {
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+
+    // global, then per module.
+    f_log_level (F_LOG_WARN);
+    info ("not shown");
+    warn ("shown");
+    const char *s = mem_read (sink);
+    check (! strstr (s, "not shown") && strstr (s, "shown"));
+    f_log_level (F_LOG_DEBUG);
+    check (f_log_module_level ("test", F_LOG_ERR));
+    iwarn ("quiet module");
+    check (! strstr (mem_read (sink), "quiet module"));
+    check (f_log_module_level ("test", F_LOG_DEBUG));
+    iwarn ("loud module");
+    check (strstr (mem_read (sink), "loud module"));
+
+    mem_route (NULL);
+    f_sink_destroy (sink);
+}
+
+static void test_log_json () {
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+    f_log_format (F_LOG_FORMAT_JSON);
+    warn ("as \"json\"");
+    const char *s = mem_read (sink);
+    check (strstr (s, "\"level\":\"warn\"") && strstr (s, "\"msg\":\"as \\\"json\\\"\""));
+    f_log_format (F_LOG_FORMAT_TEXT);
+    warn ("as text");
+    check (! strstr (mem_read (sink), "\"msg\""));
+    mem_route (NULL);
+    f_sink_destroy (sink);
+}
+
+static int count (const char *s, const char *needle) {
+    int n = 0;
+    for (const char *p = s; (p = strstr (p, needle)); p += strlen (needle))
+        n++;
+    return n;
+}
+
+static void test_rate_limit () {
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+
+    // two from the site, the rest only counted.
+    f_warn_rate_limit (2, 60000);
+    for (int i = 0; i < 5; i++)
+        iwarn ("over and over");
+    check (count (mem_read (sink), "over and over") == 2);
+
+    // a site that goes quiet is summed up by the next warning from anywhere.
+    f_warn_rate_limit (2, 50);
+    for (int i = 0; i < 5; i++)
+        iwarn ("and over");
+    warn ("too soon");
+    check (! strstr (mem_read (sink), "suppressed"));
+    usleep (150 * 1000);
+    warn ("later");
+    const char *s = mem_read (sink);
+    check (strstr (s, "suppressed 3 similar messages") && strstr (s, "later"));
+    f_warn_rate_limit (0, 0);
+
+    mem_route (NULL);
+    f_sink_destroy (sink);
+}
+
+// the second print comes from the site's cache.
+static void test_site_prefix () {
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+    for (int i = 0; i < 2; i++)
+        iwarn ("prefixed");
+    const int line = __LINE__ - 1;
+    char prefix[32];
+    snprintf (prefix, sizeof prefix, "test.c:%d", line);
+    check (count (mem_read (sink), prefix) == 2);
+    mem_route (NULL);
+    f_sink_destroy (sink);
+}
+
+static int callback_calls = 0;
+
+static void on_message (int class, const char *buf, size_t len, void *data) {
+    (void) data;
+    if (class == F_OUT_INFO && memmem (buf, len, "to the callback", 15))
+        callback_calls++;
+}
+
+static void test_sinks () {
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+    info ("into memory");
+    warn ("a warning");
+    const char *s = mem_read (sink);
+    check (strstr (s, "into memory") && strstr (s, "a warning"));
+    mem_route (NULL);
+    f_sink_destroy (sink);
+
+    sink = f_sink_callback (on_message, NULL);
+    f_out_sink (F_OUT_INFO, sink);
+    info ("to the callback");
+    info ("to the callback");
+    f_out_sink (F_OUT_INFO, NULL);
+    f_sink_destroy (sink);
+    check (callback_calls == 2);
+
+    // buffered until flushed.
+    int fds[2];
+    check (pipe2 (fds, O_NONBLOCK) == 0);
+    sink = f_sink_fd (fds[1], 0, 0);
+    f_out_sink (F_OUT_INFO, sink);
+    info ("through a pipe");
+    char buf[256] = { 0 };
+    check (read (fds[0], buf, sizeof buf - 1) == -1);
+    f_out_flush ();
+    check (read (fds[0], buf, sizeof buf - 1) > 0 && strstr (buf, "through a pipe"));
+    f_out_sink (F_OUT_INFO, NULL);
+    f_sink_destroy (sink);
+    close (fds[0]);
+    close (fds[1]);
+}
+
+static void test_timestamp () {
+    char buf[F_TIMESTAMP_LENGTH];
+    // YYYY-MM-DD HH:MM:SS.mmm
+    int n = f_timestamp (buf, sizeof buf, F_TIME_MS | F_TIME_UTC);
+    check (n == 23 && (int) strlen (buf) == n && buf[4] == '-' && buf[19] == '.');
+    check (f_timestamp (buf, 5, F_TIME_UTC) == 19 && strlen (buf) == 4);
+
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+    f_log_timestamps_f (true, F_TIME_MS | F_TIME_UTC);
+    info ("stamped");
+    f_log_timestamps (false);
+    info ("plain");
+    const char *s = mem_read (sink);
+    // buf has the year: on the first line only, before the message.
+    const char *plain = strstr (s, "plain");
+    check (plain && strstr (s, buf) && strstr (s, buf) < strstr (s, "stamped"));
+    check (plain && ! strstr (strchr (s, '\n'), buf));
+    mem_route (NULL);
+    f_sink_destroy (sink);
+}
+
+static void test_flight () {
+    check (f_flight_recorder_start (0, 0));
+    info ("for the record");
+    // recorded whatever the format or the sink.
+    f_sink *sink = mem_route (f_sink_memory (sizeof mem));
+    f_log_format (F_LOG_FORMAT_JSON);
+    warn ("also recorded");
+    f_log_format (F_LOG_FORMAT_TEXT);
+    mem_route (NULL);
+    f_sink_destroy (sink);
+    FILE *f = tmpfile ();
+    f_flight_dump (fileno (f));
+    f_flight_recorder_stop ();
+    rewind (f);
+    char buf[4096];
+    size_t n = fread (buf, 1, sizeof buf - 1, f);
+    buf[n] = '\0';
+    fclose (f);
+    check (strstr (buf, "for the record") && strstr (buf, "also recorded"));
+}
+
+static void test_sysv () {
+    f_strbuf out;
+    f_strbuf_init (&out);
+    // with and without the PATH cache; twice, so the second is a hit.
+    char *echo[] = { "echo", "a", "b", NULL };
+    for (int i = 0; i < 4; i++) {
+        f_sys_path_cache (i / 2);
+        f_strbuf_truncate (&out, 0);
+        check (sysv_capture (echo, &out) == 0 && ! strcmp (out.buf, "a b\n"));
+    }
+    char *missing[] = { "not-a-command-anywhere", NULL };
+    check (sysv_capture_f (missing, &out, NULL, 0, F_QUIET) != 0);
+    f_sys_path_cache (false);
+
+    char *fail[] = { "sh", "-c", "exit 3", NULL };
+    FILE *f = sysv_r (fail);
+    check (f && f_sys_pid (f) > 0);
+    if (f)
+        check (sysclose_f (f, NULL, F_QUIET) == 3);
+    f_strbuf_free (&out);
+}
+
+static void test_capture () {
+    f_strbuf out, err;
+    f_strbuf_init (&out);
+    f_strbuf_init (&err);
+    check (sys_capture ("echo out; echo err >&2", &out) == 0 && ! strcmp (out.buf, "out\n"));
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture_f ("echo out; echo err >&2; exit 2", &out, &err, 0, F_QUIET) == 2);
+    check (! strcmp (out.buf, "out\n") && ! strcmp (err.buf, "err\n"));
+    // cut at max, the rest drained so the command isn't stuck.
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture_f ("head -c 100000 /dev/zero | tr '\\0' x", &out, NULL, 10, 0) == 0 && out.len == 10);
+    f_strbuf_free (&out);
+    f_strbuf_free (&err);
+}
+
+// both ways; a lot of input, handed over with vmsplice.
+static void test_pump () {
+    f_strbuf out;
+    f_strbuf_init (&out);
+    size_t len = 1 << 20;
+    char *in = f_malloc (len);
+    memset (in, 'y', len);
+    int in_fd, out_fd;
+    pid_t pid = sysrw ("cat", &in_fd, &out_fd);
+    check (pid > 0);
+    if (pid > 0)
+        check (sysrw_pump (pid, in_fd, out_fd, in, len, &out, F_SPLICE) == 0 && out.len == len);
+    check (out.len == len && out.buf[0] == 'y' && out.buf[len - 1] == 'y');
+    f_free (in);
+    f_strbuf_free (&out);
+}
+
+static void test_jobs () {
+    f_jobs *jobs = f_jobs_new (2);
+    f_jobs_add (jobs, "echo one");
+    f_jobs_add (jobs, "exit 3");
+    char *argv[] = { "echo", "two", NULL };
+    f_jobs_addv (jobs, argv);
+
+    // a second run starts from scratch.
+    for (int run = 0; run < 2; run++) {
+        check (f_jobs_run (jobs, F_QUIET) == 1);
+        check (! strcmp (f_jobs_get (jobs, 0)->out.buf, "one\n"));
+        check (f_jobs_get (jobs, 1)->status == 3);
+        check (! strcmp (f_jobs_get (jobs, 2)->out.buf, "two\n"));
+        check (f_jobs_get (jobs, 2)->status == 0);
+    }
+    f_jobs_destroy (jobs);
+
+    f_sys_timeout (0.2, 0.2);
+    jobs = f_jobs_new (0);
+    f_jobs_add (jobs, "sleep 5");
+    f_jobs_add (jobs, "trap '' TERM; exec sleep 5");
+    f_jobs_add (jobs, "true");
+    check (f_jobs_run (jobs, F_QUIET) == 2);
+    check (f_jobs_get (jobs, 0)->status == F_SYS_TIMEOUT);
+    check (f_jobs_get (jobs, 1)->status == F_SYS_TIMEOUT);
+    check (f_jobs_get (jobs, 1)->wall < 2);
+    check (f_jobs_get (jobs, 2)->status == 0);
+    f_jobs_destroy (jobs);
+    f_sys_timeout (0, 0);
+}
+
+static void test_sys () {
+    struct f_sys_usage u;
+    check (sys ("exit 5") == 5);
+    check (f_sys_last_usage (&u));
+    check (! u.timed_out);
+    check (u.wall >= 0 && u.wall < 5);
+
+    f_sys_timeout (0.2, 0.2);
+    check (sys ("sleep 5") == F_SYS_TIMEOUT);
+    check (f_sys_last_usage (&u));
+    check (u.timed_out);
+    check (u.wall < 2);
+
+    // ignores SIGTERM: gets SIGKILL after the grace period.
+    check (sys ("trap '' TERM; exec sleep 5") == F_SYS_TIMEOUT);
+    check (f_sys_last_usage (&u));
+    check (u.timed_out);
+    check (u.wall >= 0.3 && u.wall < 2);
+    f_sys_timeout (0, 0);
+}
+
+static void test_pipeline () {
+    char *echo[] = { "echo", "hello", NULL };
+    char *tr[] = { "tr", "h", "H", NULL };
+    f_pipeline *p = f_pipeline_new ();
+    f_pipeline_add (p, echo);
+    f_pipeline_add (p, tr);
+    check (f_pipeline_start (p, F_READ));
+    char buf[16] = { 0 };
+    check (read (f_pipeline_tail (p), buf, sizeof buf - 1) == 6);
+    check (! strcmp (buf, "Hello\n"));
+    check (f_pipeline_wait (p, 0) == 0);
+    f_pipeline_destroy (p);
+
+    // killed by a signal: 128 + 9, from wait and from status.
+    char *suicide[] = { "sh", "-c", "kill -9 $$", NULL };
+    char *cat[] = { "cat", NULL };
+    p = f_pipeline_new ();
+    f_pipeline_add (p, suicide);
+    f_pipeline_add (p, cat);
+    check (f_pipeline_start (p, 0));
+    check (f_pipeline_wait (p, F_QUIET) == 137);
+    check (f_pipeline_status (p, 0) == 137);
+    check (f_pipeline_status (p, 1) == 0);
+    f_pipeline_destroy (p);
+
+    // the second stage doesn't start: the first gets killed.
+    char *nap[] = { "sleep", "5", NULL };
+    char *nothing[] = { "/non-existent", NULL };
+    double t = f_time_hires ();
+    p = f_pipeline_new ();
+    f_pipeline_add (p, nap);
+    f_pipeline_add (p, nothing);
+    check (! f_pipeline_start (p, F_WRITE));
+    check (f_pipeline_head (p) == -1);
+    check (f_pipeline_status (p, 0) == -1);
+    check (f_pipeline_status (p, 1) == -1);
+    f_pipeline_destroy (p);
+    check (f_time_hires () - t < 2);
+
+    // stages which ignore SIGTERM: one grace period, not one each.
+    char *stubborn[] = { "sh", "-c", "trap '' TERM; exec sleep 5", NULL };
+    f_sys_timeout (0.2, 0.3);
+    t = f_time_hires ();
+    p = f_pipeline_new ();
+    for (int i = 0; i < 3; i++)
+        f_pipeline_add (p, stubborn);
+    check (f_pipeline_start (p, 0));
+    check (f_pipeline_wait (p, F_QUIET) == F_SYS_TIMEOUT);
+    check (f_pipeline_status (p, 2) == F_SYS_TIMEOUT);
+    check (f_time_hires () - t < 0.9);
+    f_pipeline_destroy (p);
+    f_sys_timeout (0, 0);
+}
+
+static void test_coproc () {
+    f_sys_coproc (true);
+    f_strbuf out;
+    f_strbuf_init (&out);
+
+    // sysr: NULs survive, and there's an fd.
+    FILE *f = sysr ("printf 'a\\0b'");
+    check (f && fileno (f) != -1);
+    char buf[8];
+    check (f && fread (buf, 1, sizeof buf, f) == 3 && ! memcmp (buf, "a\0b", 3));
+    if (f)
+        check (sysclose (f) == 0);
+
+    // our cwd and environment, not the ones the shell started with.
+    char cwd[4096];
+    check (getcwd (cwd, sizeof cwd) != NULL);
+    check (chdir ("/tmp") == 0);
+    check (sys_capture ("pwd", &out) == 0 && ! strcmp (out.buf, "/tmp\n"));
+    check (chdir (cwd) == 0);
+    setenv ("FISH_UTIL_TEST", "one", 1);
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo $FISH_UTIL_TEST", &out) == 0 && ! strcmp (out.buf, "one\n"));
+    setenv ("FISH_UTIL_TEST", "two", 1);
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo $FISH_UTIL_TEST", &out) == 0 && ! strcmp (out.buf, "two\n"));
+    unsetenv ("FISH_UTIL_TEST");
+
+    // the shell dies in between: the next command gets a new one.
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo $$", &out) == 0);
+    pid_t shell = atoi (out.buf);
+    check (shell > 0 && kill (shell, SIGKILL) == 0);
+    usleep (50000);
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo again", &out) == 0 && ! strcmp (out.buf, "again\n"));
+
+    // a timeout takes out what the command started too.
+    unlink ("/tmp/fish-util-test-coproc");
+    f_sys_timeout (0.2, 0.2);
+    check (sys ("(sleep 1; touch /tmp/fish-util-test-coproc) & sleep 5") == F_SYS_TIMEOUT);
+    f_sys_timeout (0, 0);
+    usleep (1200000);
+    check (access ("/tmp/fish-util-test-coproc", F_OK) == -1);
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo after", &out) == 0 && ! strcmp (out.buf, "after\n"));
+
+    // turning it off stops the shell.
+    f_strbuf_truncate (&out, 0);
+    check (sys_capture ("echo $$", &out) == 0);
+    shell = atoi (out.buf);
+    f_sys_coproc (false);
+    check (shell > 0 && kill (shell, 0) == -1);
+    f_strbuf_free (&out);
+}
+
+static f_loop *loop;
+static int fired[3];
+static int repeat_id;
+static int accepted;
+static int closed;
+
+static void on_once (void *data) {
+    fired[0]++;
+}
+
+static void on_repeat (void *data) {
+    if (++fired[1] == 3)
+        f_loop_timer_cancel (loop, repeat_id);
+}
+
+static void on_cancelled (void *data) {
+    fired[2]++;
+}
+
+static void on_stop (void *data) {
+    f_loop_stop (loop);
+}
+
+static void on_accept (f_conn *c) {
+    accepted++;
+}
+
+// echo whole lines.
+static void on_readable (f_conn *c) {
+    f_strbuf *in = f_conn_in (c);
+    char *nl = strrchr (in->buf, '\n');
+    if (! nl)
+        return;
+    size_t n = nl + 1 - in->buf;
+    f_conn_write (c, in->buf, n);
+    f_conn_consume (c, n);
+}
+
+static void on_closed (f_conn *c) {
+    closed++;
+}
+
+static void test_loop () {
+    loop = f_loop_new ();
+    f_loop_timer (loop, 30, false, on_once, NULL);
+    repeat_id = f_loop_timer (loop, 5, true, on_repeat, NULL);
+    int id = f_loop_timer (loop, 10, false, on_cancelled, NULL);
+    f_loop_timer_cancel (loop, id);
+    // returns by itself once the timers are done.
+    check (f_loop_run (loop) == 0);
+    check (fired[0] == 1 && fired[1] == 3 && fired[2] == 0);
+
+    struct f_conn_callbacks cb = {
+        .accept = on_accept,
+        .readable = on_readable,
+        .closed = on_closed,
+    };
+    int sv[2];
+    check (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    check (f_loop_add_fd (loop, sv[0], &cb, NULL) != NULL);
+    check (accepted == 1);
+    check (write (sv[1], "one\ntw", 6) == 6);
+    check (write (sv[1], "o\n", 2) == 2);
+    shutdown (sv[1], SHUT_WR);
+    check (f_loop_run (loop) == 0);
+    check (closed == 1 && f_loop_num_conns (loop) == 0);
+    char buf[16] = { 0 };
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read (sv[1], buf + got, sizeof buf - 1 - got)) > 0)
+        got += n;
+    check (got == 8 && ! strcmp (buf, "one\ntwo\n"));
+    close (sv[1]);
+
+    // out of fds: waiting connections get dropped, not left hanging.
+    char *path = "/tmp/fish-util-test-loop";
+    unlink (path);
+    int l = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy (addr.sun_path, path);
+    check (bind (l, (struct sockaddr *) &addr, sizeof addr) == 0);
+    check (f_socket_listen (l, 0));
+    int client[3];
+    for (int i = 0; i < 3; i++) {
+        client[i] = socket (AF_UNIX, SOCK_STREAM, 0);
+        check (connect (client[i], (struct sockaddr *) &addr, sizeof addr) == 0);
+    }
+    struct rlimit old, low;
+    getrlimit (RLIMIT_NOFILE, &old);
+    low = old;
+    low.rlim_cur = 64;
+    setrlimit (RLIMIT_NOFILE, &low);
+    int filler[64], num_filler = 0;
+    while (num_filler < 64 && (filler[num_filler] = open ("/dev/null", O_RDONLY)) != -1)
+        num_filler++;
+    accepted = 0;
+    check (f_loop_listen (loop, l, &cb, NULL));
+    f_loop_timer (loop, 100, false, on_stop, NULL);
+    check (f_loop_run (loop) == 0);
+    check (accepted == 0);
+    for (int i = 0; i < 3; i++) {
+        check (read (client[i], buf, 1) == 0);
+        close (client[i]);
+    }
+    for (int i = 0; i < num_filler; i++)
+        close (filler[i]);
+    setrlimit (RLIMIT_NOFILE, &old);
+    f_loop_destroy (loop);
+    unlink (path);
+}
+
 int main (int argc, char** argv) {
 
     info ("info.");
@@ -35,7 +759,35 @@ int main (int argc, char** argv) {
     int len4 = f_int_length (4567);
     info ("Length of 4567 is %d", len4);
 
-    return 0;
+    f_verbose_cmds (false);
+    test_pool ();
+    test_alloc_stats ();
+    test_heap_profile ();
+    test_static_str ();
+    test_strbuf ();
+    test_color ();
+    test_intern ();
+    test_big_alloc ();
+    test_async ();
+    test_log_level ();
+    test_log_json ();
+    test_rate_limit ();
+    test_site_prefix ();
+    test_sinks ();
+    test_timestamp ();
+    test_flight ();
+    test_sysv ();
+    test_capture ();
+    test_pump ();
+    test_sys ();
+    test_jobs ();
+    test_pipeline ();
+    test_coproc ();
+    test_loop ();
+
+    if (fails)
+        warn ("%d checks failed.", fails);
+    return fails ? 1 : 0;
 
     /* for (int i = 0; i < 2; i++) {
        char *re = regex[i];
@@ -49,6 +49,14 @@
 #include "fish-utils/regex.h"
 
 void f_track_heap(void *ptr);
+
+/* Everything passed to f_track_heap between a push and its pop is freed by
+ * the pop. Scopes nest and are per thread; outside a scope, tracked
+ * pointers live until fish_utils_cleanup.
+ */
+int f_heap_scope_push();
+bool f_heap_scope_pop();
+int f_heap_scope_depth();
 void fish_utils_init();
 void fish_utils_cleanup();
 
@@ -10,16 +10,59 @@
 
 static vec *_fish_utils_heap = NULL;
 
+/* Stack of vecs, one per open scope.
+ */
+static __thread vec *_heap_scopes = NULL;
+
 void fish_utils_init() {
     _fish_utils_heap = vec_new();
 }
 
 void f_track_heap(void *ptr) {
-    if (! vec_add(_fish_utils_heap, ptr))
+    vec *v = _heap_scopes ? vec_last(_heap_scopes) : _fish_utils_heap;
+    if (! vec_add(v, ptr))
         piep;
 }
 
+/* Returns the new depth.
+ */
+int f_heap_scope_push() {
+    if (! _heap_scopes) {
+        _heap_scopes = vec_new();
+        if (! _heap_scopes)
+            pieprneg1;
+    }
+    vec *scope = vec_new();
+    if (! scope)
+        pieprneg1;
+    if (! vec_add(_heap_scopes, scope)) {
+        vec_destroy(scope);
+        pieprneg1;
+    }
+    return vec_size(_heap_scopes);
+}
+
+bool f_heap_scope_pop() {
+    if (! _heap_scopes)
+        pieprf;
+    vec *scope = vec_pop(_heap_scopes);
+    if (! vec_size(_heap_scopes)) {
+        vec_destroy(_heap_scopes);
+        _heap_scopes = NULL;
+    }
+    if (! vec_destroy_deep(scope))
+        pieprf;
+    return true;
+}
+
+int f_heap_scope_depth() {
+    return _heap_scopes ? vec_size(_heap_scopes) : 0;
+}
+
 void fish_utils_cleanup() {
+    while (_heap_scopes)
+        if (! f_heap_scope_pop())
+            break;
     if (! _fish_utils_heap)
         piepr;
     if (!vec_destroy_f(_fish_utils_heap, VEC_DESTROY_DEEP))
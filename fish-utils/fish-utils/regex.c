@@ -150,8 +150,9 @@ int match_full(char *target, char *regexp_s, char *ret[], int target_len /* with
                 ret[++idx] = match;
 
             /* match'es will be freed when fish_utils_cleanup() is
-             * called. convenient but footprint will get big if program does
-             * lots of matches.
+             * called, or by f_heap_scope_pop() if a scope is open.
+             * convenient but footprint will get big if program does lots
+             * of matches outside of a scope.
              */
             if (auto_gc)
                 f_track_heap(match);
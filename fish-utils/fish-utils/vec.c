@@ -23,6 +23,7 @@ vec *vec_new() {
     v->n = 0;
     v->cap = VEC_CAP;
     v->_data = calloc(VEC_CAP, sizeof(void*));
+    v->_big = false;
     return v;
 }
 
@@ -39,7 +40,24 @@ bool vec_add(vec *v, void *ptr) {
         G(_s);
         debug("vec %p: reallocating: size -> %s", v, _t);
 
-        void **new = realloc(v->_data, newcap * sizeof(void*));
+        /* Past the big threshold, move to mmap'ed memory and grow with
+         * mremap from then on.
+         */
+        size_t bytes = newcap * sizeof(void*);
+        size_t threshold = f_big_threshold();
+        void **new;
+        if (v->_big)
+            new = f_big_realloc(v->_data, bytes, f_big_flags());
+        else if (threshold && bytes >= threshold) {
+            new = f_big_alloc(bytes, f_big_flags());
+            if (new) {
+                memcpy(new, v->_data, v->cap * sizeof(void*));
+                free(v->_data);
+                v->_big = true;
+            }
+        }
+        else
+            new = realloc(v->_data, bytes);
 
         if (!new) {
             _();
@@ -81,6 +99,18 @@ void *vec_last(vec *v) {
     return v->_data[v->n - 1];
 }
 
+/* Removes and returns the last element, or NULL if the vector is empty.
+ */
+void *vec_pop(vec *v) {
+    if (v == NULL)
+        pieprnull;
+    if (! v->n)
+        return NULL;
+    void *ptr = v->_data[--v->n];
+    v->_data[v->n] = NULL;
+    return ptr;
+}
+
 bool vec_destroy_deep(vec *v) {
     return vec_destroy_f(v, VEC_DESTROY_DEEP);
 }
@@ -93,7 +123,10 @@ bool vec_destroy_f(vec *v, int flags) {
         if (!vec_clear_f(v, VEC_CLEAR_DEEP))
             pieprf;
     }
-    free(v->_data);
+    if (v->_big)
+        f_big_free(v->_data);
+    else
+        free(v->_data);
     free(v);
     return true;
 }
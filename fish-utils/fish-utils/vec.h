@@ -7,10 +7,13 @@
 #define VEC_DESTROY_DEEP    0x01
 #define VEC_CLEAR_DEEP      0x02
 
+/* _big: _data is from f_big_alloc (see f_big_config).
+ */
 typedef struct vec {
     int n;
     int cap;
     void **_data;
+    bool _big;
 } vec;
 
 vec *vec_new();
@@ -18,6 +21,7 @@ int vec_size(vec *v);
 bool vec_add(vec *v, void *ptr);
 void *vec_get(vec *v, int n);
 void *vec_last(vec *v);
+void *vec_pop(vec *v);
 
 /* vec_destroy should be void, while _deep and _f should be bool.
  * XX
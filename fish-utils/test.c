@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+
+#include "fish-utils.h"
+
+/* Blocks this big are mmapped (main pins the threshold, which glibc would
+ * otherwise raise after the first free), so freeing them shows up in
+ * mallinfo2 right away.
+ */
+#define BIG (1024 * 1024)
+
+static int fails = 0;
+
+#define check(x) do { \
+    if (! (x)) { \
+        fprintf(stderr, "%s:%d Check failed: %s\n", __FILE__, __LINE__, #x); \
+        fails++; \
+    } \
+} while (0)
+
+static size_t mapped() {
+    return mallinfo2().hblkhd;
+}
+
+static void test_nesting() {
+    check(f_heap_scope_depth() == 0);
+    check(f_heap_scope_push() == 1);
+    check(f_heap_scope_push() == 2);
+    check(f_heap_scope_depth() == 2);
+    check(f_heap_scope_pop());
+    check(f_heap_scope_depth() == 1);
+    check(f_heap_scope_pop());
+    check(f_heap_scope_depth() == 0);
+}
+
+static void test_pop_frees() {
+    size_t before = mapped();
+    f_heap_scope_push();
+    f_track_heap(malloc(BIG));
+    f_heap_scope_push();
+    f_track_heap(malloc(BIG));
+    check(mapped() >= before + 2 * BIG);
+
+    // only the inner scope's block goes.
+    f_heap_scope_pop();
+    check(mapped() >= before + BIG && mapped() < before + 2 * BIG);
+    f_heap_scope_pop();
+    check(mapped() < before + BIG);
+}
+
+static void *scope_thread(void *arg) {
+    (void) arg;
+    check(f_heap_scope_depth() == 0);
+    check(f_heap_scope_push() == 1);
+    size_t before = mapped();
+    f_track_heap(malloc(BIG));
+    check(f_heap_scope_pop());
+    check(mapped() < before + BIG);
+    return NULL;
+}
+
+static void test_threads() {
+    f_heap_scope_push();
+    size_t before = mapped();
+    f_track_heap(malloc(BIG));
+    pthread_t t;
+    check(! pthread_create(&t, NULL, scope_thread, NULL));
+    pthread_join(t, NULL);
+    // the thread's pop didn't touch this thread's scope.
+    check(f_heap_scope_depth() == 1);
+    check(mapped() >= before + BIG);
+    f_heap_scope_pop();
+    check(mapped() < before + BIG);
+}
+
+int main() {
+    mallopt(M_MMAP_THRESHOLD, BIG / 2);
+    fish_utils_init();
+    test_nesting();
+    test_pop_frees();
+    test_threads();
+    fish_utils_cleanup();
+
+    if (fails)
+        warn("%d checks failed.", fails);
+    return fails ? 1 : 0;
+}